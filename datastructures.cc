@@ -2,27 +2,86 @@
 
 #include "datastructures.hh"
 
-#include <random>
 #include <cmath>
 #include <algorithm>
 #include <stack>
 #include <queue>
+#include <fstream>
+#include <future>
+#include <thread>
+#include <charconv>
+#include <string_view>
+#include <chrono>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 // ---------------------------- PROVIDED BY THE COURSE ------------------------
 
 std::minstd_rand rand_engine; // Reasonably quick pseudo-random generator
 
-template <typename Type>
-Type random_in_range(Type start, Type end)
+// ----------------------------------------------------------------------------
+
+// ---------------------------- Instrumentation -------------------------------
+
+#ifdef DATASTRUCTURES_STATS
+
+namespace {
+
+// Stats of the operation currently running in this thread, work counters are
+// added here
+thread_local OperationStats* current_stats_ = nullptr;
+
+// Times one call of an operation and directs the work counters of the call
+// to its stats for as long as it runs.
+class OperationTimer
 {
-    auto range = end-start;
-    ++range;
+public:
+    explicit OperationTimer(OperationStats& stats) :
+        stats_(stats), previous_(current_stats_),
+        start_(std::chrono::steady_clock::now())
+    {
+        current_stats_ = &stats_;
+    }
 
-    auto num = std::uniform_int_distribution<unsigned long int>(0, range-1)(rand_engine);
+    ~OperationTimer()
+    {
+        auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start_).count();
+        auto ns = static_cast<unsigned long>(std::max<long long>(elapsed, 1));
+        std::size_t bucket = 0;
+        while (bucket + 1 < LATENCY_BUCKETS and (ns >> (bucket + 1)) != 0) {
+            ++bucket;
+        }
+        ++stats_.calls;
+        stats_.total_ns += ns;
+        ++stats_.latency_histogram.at(bucket);
+        current_stats_ = previous_;
+    }
+
+private:
+    OperationStats& stats_;
+    OperationStats* previous_;
+    std::chrono::steady_clock::time_point start_;
+};
 
-    return static_cast<Type>(start+num);
 }
 
+#define DS_TIME_OPERATION() OperationTimer operation_timer(stats_[__func__])
+#define DS_COUNT(counter, amount) \
+    do { if (current_stats_) { current_stats_->counter += (amount); } } while (false)
+#define DS_MAX(counter, value) \
+    do { if (current_stats_) { current_stats_->counter = std::max(current_stats_->counter, (value)); } } while (false)
+
+#else
+
+#define DS_TIME_OPERATION() do {} while (false)
+#define DS_COUNT(counter, amount) do {} while (false)
+#define DS_MAX(counter, value) do {} while (false)
+
+#endif
+
 // ----------------------------------------------------------------------------
 
 // Modify the code below to implement the functionality of the class.
@@ -30,291 +89,247 @@ Type random_in_range(Type start, Type end)
 // an operation (Commenting out parameter name prevents compiler from
 // warning about unused parameters on operations you haven't yet implemented.)
 
-Datastructures::Datastructures() :
-    beacons_({}),
-    alphabetical_order_({}),
-    brightness_order_({})
+// ---------------------------- Beacon storage --------------------------------
+
+namespace {
+
+// Size of the heap buffer of a string, zero if it fits the short string buffer
+std::size_t string_heap_bytes(std::string const& s)
 {
+    return s.capacity() > std::string().capacity() ? s.capacity() + 1 : 0;
 }
 
-Datastructures::~Datastructures()
+// Estimated size of a node-based hash table: the bucket array, and a node
+// with the element, a next pointer and the cached hash for each element
+template <typename Map>
+std::size_t hash_table_bytes(Map const& map)
 {
+    return map.bucket_count() * sizeof(void*)
+            + map.size() * (sizeof(typename Map::value_type) + 2 * sizeof(void*));
 }
 
-int Datastructures::beacon_count()
+// Estimated size of a red-black tree node holding a Value
+template <typename Value>
+std::size_t set_node_bytes()
 {
-    return static_cast<int>(beacons_.size());
+    return sizeof(Value) + 4 * sizeof(void*);
 }
 
-void Datastructures::clear_beacons()
+template <typename Column>
+std::size_t column_bytes(Column const& column)
 {
-    beacons_.clear();
-    alphabetical_order_.clear();
-    brightness_order_.clear();
+    return column.capacity() * sizeof(typename Column::value_type);
 }
 
-
-std::vector<BeaconID> Datastructures::all_beacons()
+// Heap buffers of the strings in a paged column
+std::size_t string_heap_bytes(PagedColumn<std::string> const& column)
 {
-    std::vector<BeaconID> ids;
-    ids.reserve(beacons_.size());
-    for (const auto& beacon : beacons_) {
-        ids.push_back(beacon.first);
-    }
-    return ids;
+    std::size_t bytes = 0;
+    column.for_each_page([&](std::size_t, std::string const* strings, std::size_t count) {
+        for (std::size_t i = 0; i < count; ++i) {
+            bytes += string_heap_bytes(strings[i]);
+        }
+    });
+    return bytes;
 }
 
-bool Datastructures::add_beacon(BeaconID id, const std::string& name, Coord xy, Color color)
+// True if rebuilding an ordered structure of size n from scratch is cheaper
+// than applying k changes to it one by one
+bool rebuild_is_cheaper(std::size_t k, std::size_t n)
 {
-    const auto result = beacons_.find(id);
-    if (result != beacons_.end()) {
-        return false;
-    }
-    int new_beacon_brightness = get_brightness(color);
-    Beacon new_beacon = { id, name, xy, color, new_beacon_brightness };
-    beacons_[id] = new_beacon;
-    alphabetical_order_.insert({name, id});
-    brightness_order_.insert({new_beacon_brightness, id});
-    return true;
+    return static_cast<double>(k) * std::log2(static_cast<double>(n) + 2) > static_cast<double>(n);
 }
 
-std::string Datastructures::get_name(BeaconID id)
+// Inserts node into a sorted sequence, right after the nodes less than it
+template <typename Less>
+void insert_sorted(TreapForest& forest, TreapForest::Node& root, TreapForest::Node node, Less less)
 {
-    const auto result = beacons_.find(id);
-    if (result != beacons_.end()) {
-        return result->second.name;
-    }
-    return NO_NAME;
+    root = forest.insert(root, node, [&](TreapForest::Node other) { return less(other, node); });
 }
 
-Coord Datastructures::get_coordinates(BeaconID id)
+// Takes node out of its sequence, leaving it a sequence of its own
+void erase_node(TreapForest& forest, TreapForest::Node& root, TreapForest::Node node)
 {
-    const auto result = beacons_.find(id);
-    if (result != beacons_.end()) {
-        return result->second.coords;
-    }
-    return NO_COORD;
+    root = forest.erase(root, node);
 }
 
-Color Datastructures::get_color(BeaconID id)
+std::string beacon_name(BeaconStore const& beacons, BeaconID const& id)
 {
-    const auto result = beacons_.find(id);
-    if (result != beacons_.end()) {
-        return result->second.color;
+    Row row = beacons.find(id);
+    if (row == NO_ROW) {
+        return NO_NAME;
     }
-    return NO_COLOR;
+    return std::string(beacons.name(row));
 }
 
-
-std::vector<BeaconID> Datastructures::beacons_alphabetically()
+Coord beacon_coordinates(BeaconStore const& beacons, BeaconID const& id)
 {
-    std::vector<BeaconID> ids = {};
-    ids.reserve(alphabetical_order_.size());
-    for (const auto& beacon : alphabetical_order_) {
-        ids.push_back(beacon.second);
+    Row row = beacons.find(id);
+    if (row == NO_ROW) {
+        return NO_COORD;
     }
-    return ids;
+    return beacons.coords(row);
 }
 
-std::vector<BeaconID> Datastructures::beacons_brightness_increasing()
+Color beacon_color(BeaconStore const& beacons, BeaconID const& id)
 {
-    std::vector<BeaconID> ids = {};
-    ids.reserve(brightness_order_.size());
-    for (const auto& beacon : brightness_order_) {
-        ids.push_back(beacon.second);
+    Row row = beacons.find(id);
+    if (row == NO_ROW) {
+        return NO_COLOR;
     }
-    return ids;
+    return beacons.color(row);
 }
 
-BeaconID Datastructures::min_brightness()
+std::vector<BeaconID> lightsources(BeaconStore const& beacons, BeaconID const& id)
 {
-    if (brightness_order_.size() == 0){
-        return NO_ID;
+    Row row = beacons.find(id);
+    if (row == NO_ROW) {
+        return {{NO_ID}};
+    }
+    std::vector<BeaconID> sources;
+    for (Row source = beacons.first_source(row); source != NO_ROW; source = beacons.next_source(source)) {
+        sources.push_back(beacons.id(source));
     }
-    const auto it = brightness_order_.begin();
-    return it->second;
+    return sources;
 }
 
-BeaconID Datastructures::max_brightness()
+std::vector<BeaconID> all_lightsources(BeaconStore const& beacons, BeaconID const& id)
 {
-    if (brightness_order_.size() == 0){
-        return NO_ID;
+    Row row = beacons.find(id);
+    if (row == NO_ROW) {
+        return {{NO_ID}};
+    }
+    std::vector<Row> rows;
+    beacons.upstream_rows(row, rows);
+    std::vector<BeaconID> sources;
+    sources.reserve(rows.size());
+    for (const auto& source : rows) {
+        sources.push_back(beacons.id(source));
     }
-    const auto it = brightness_order_.rbegin();
-    return it->second;
+    std::sort(sources.begin(), sources.end());
+    return sources;
 }
 
-std::vector<BeaconID> Datastructures::find_beacons(std::string const& name)
+int all_lightsources_count(BeaconStore const& beacons, BeaconID const& id)
 {
-    std::vector<BeaconID> found_ids;
-    for (const auto& beacon : beacons_) {
-        if (beacon.second.name == name){
-            found_ids.push_back(beacon.second.id);
-        }
+    Row row = beacons.find(id);
+    if (row == NO_ROW) {
+        return NO_VALUE;
     }
-    std::sort(found_ids.begin(),found_ids.end());
-    return found_ids;
+    return static_cast<int>(beacons.upstream_count(row));
 }
 
-bool Datastructures::change_beacon_name(BeaconID id, const std::string& newname)
+bool upstream(BeaconStore const& beacons, BeaconID const& upstreamid, BeaconID const& downstreamid)
 {
-    auto result = beacons_.find(id);
-    if (result != beacons_.end()) {
-        std::string oldname = result->second.name;
-        result->second.name = newname;
-        auto range = alphabetical_order_.equal_range(oldname);
-        for (auto i = range.first; i != range.second; ++i){
-            if (i->second == id) {
-                auto node_handler = alphabetical_order_.extract(i->first);
-                node_handler.key() = newname;
-                alphabetical_order_.insert(std::move(node_handler));
-                return true;
-            }
-        }
-    }
-    return false;
+    Row upstream = beacons.find(upstreamid);
+    Row downstream = beacons.find(downstreamid);
+    return upstream != NO_ROW and downstream != NO_ROW and beacons.is_upstream(upstream, downstream);
 }
 
-bool Datastructures::change_beacon_color(BeaconID id, Color newcolor)
+std::vector<BeaconID> outbeam_path(BeaconStore const& beacons, BeaconID const& id)
 {
-    auto result = beacons_.find(id);
-    if (result != beacons_.end()) {
-        int new_brightness = get_brightness(newcolor);
-        int old_brightness = result->second.brightness;
-        result->second.color = newcolor;
-        result->second.brightness = new_brightness;
-        auto range = brightness_order_.equal_range(old_brightness);
-        for (auto& i = range.first; i != range.second; ++i) {
-            if (i->second == id) {
-                auto node_handler = brightness_order_.extract(i->first);
-                node_handler.key() = new_brightness;
-                brightness_order_.insert(std::move(node_handler));
-                return true;
-            }
-        }
+    Row row = beacons.find(id);
+    if (row == NO_ROW) {
+        return {{NO_ID}};
     }
-    return false;
+    std::vector<BeaconID> ids;
+    for (; row != NO_ROW; row = beacons.target(row)) {
+        ids.push_back(beacons.id(row));
+    }
+    return ids;
 }
 
-
-bool Datastructures::add_lightbeam(BeaconID sourceid, BeaconID targetid)
+std::vector<BeaconID> ids_in_row_order(BeaconStore const& beacons)
 {
-    auto source_it = beacons_.find(sourceid);
-    auto target_it = beacons_.find(targetid);
-    if ( source_it == beacons_.end() or target_it == beacons_.end()) {
-        return false;
-    } else if (source_it->second.target != NO_ID) {
-        return false;
+    std::vector<BeaconID> ids;
+    ids.reserve(beacons.size());
+    for (Row row = 0; row < beacons.end(); ++row) {
+        if (beacons.alive(row)) {
+            ids.push_back(beacons.id(row));
+        }
     }
-    source_it->second.target = targetid;
-    target_it->second.sources.push_back(sourceid);
-    return true;
+    return ids;
 }
 
-std::vector<BeaconID> Datastructures::get_lightsources(BeaconID id)
+std::vector<BeaconID> ids_by_name(BeaconStore const& beacons)
 {
-    auto result = beacons_.find(id);
-    if (result == beacons_.end()) {
-        return {{NO_ID}};
+    std::vector<BeaconID> ids;
+    ids.reserve(beacons.size());
+    for (Row row = beacons.first_by_name(); row != NO_ROW; row = beacons.next_by_name(row)) {
+        ids.push_back(beacons.id(row));
     }
-    auto sources = result->second.sources;
-    std::sort(sources.begin(), sources.end());
-    return sources;
+    return ids;
 }
 
-std::vector<BeaconID> Datastructures::path_outbeam(BeaconID id)
+std::vector<BeaconID> ids_by_brightness(BeaconStore const& beacons)
 {
-    const auto result = beacons_.find(id);
-    if (result == beacons_.end()) {
-        return {{NO_ID}};
-    }
     std::vector<BeaconID> ids;
-    ids.push_back(id);
-    auto target = result->second.target;
-    while (target != NO_ID) {
-        ids.push_back(target);
-        target = beacons_.at(target).target;
+    ids.reserve(beacons.size());
+    for (Row row = beacons.first_by_brightness(); row != NO_ROW; row = beacons.next_by_brightness(row)) {
+        ids.push_back(beacons.id(row));
     }
     return ids;
 }
 
-bool Datastructures::remove_beacon(BeaconID id)
+BeaconID id_or_none(BeaconStore const& beacons, Row row)
 {
-    const auto result = beacons_.find(id);
-    if (result == beacons_.end()) {
-        return false;
-    }
-    const auto& target = result->second.target;
-    if (target != NO_ID) {
-        auto& targets_sources = beacons_.at(target).sources;
-        targets_sources.erase(std::remove_if(targets_sources.begin(), targets_sources.end(),
-                                             [=](auto& source){ return source == id; }));
-    }
-    for (const auto& source : result->second.sources){
-        beacons_.at(source).target = NO_ID;
-    }
-    for (auto it = alphabetical_order_.begin(); it != alphabetical_order_.end(); ++it){
-        if (it->second == id) {
-            alphabetical_order_.erase(it);
-            break;
-        }
-    }
-    for (auto it = brightness_order_.begin(); it != brightness_order_.end(); ++it){
-        if (it->second == id) {
-            brightness_order_.erase(it);
-            break;
-        }
-    }
-    beacons_.erase(result);
-    return true;
+    return row == NO_ROW ? NO_ID : beacons.id(row);
 }
 
-std::vector<BeaconID> Datastructures::path_inbeam_longest(BeaconID id)
+std::vector<BeaconID> ids_named(BeaconStore const& beacons, std::string const& name)
 {
-    auto result = beacons_.find(id);
-    if (result == beacons_.end()) {
-        return {{NO_ID}};
+    std::vector<BeaconID> found_ids;
+    for (Row row = beacons.lower_bound_name(name); row != NO_ROW and beacons.name(row) == name;
+         row = beacons.next_by_name(row)) {
+        found_ids.push_back(beacons.id(row));
     }
-    std::deque<BeaconID> atm;
-    std::deque<BeaconID> longest;
-    path_inbeam_recursive(id, atm, longest);
-    std::vector<BeaconID> longest_vector(longest.begin(), longest.end());
-    return longest_vector;
-
+    DS_COUNT(entries_scanned, found_ids.size());
+    std::sort(found_ids.begin(), found_ids.end());
+    return found_ids;
 }
 
-void Datastructures::path_inbeam_recursive(BeaconID id, std::deque<BeaconID> atm, std::deque<BeaconID>& longest)
+void inbeam_path_recursive(BeaconStore const& beacons, Row row, std::deque<BeaconID> atm, std::deque<BeaconID>& longest)
 {
-    auto result = beacons_.find(id);
-    atm.push_front(id);
+    atm.push_front(beacons.id(row));
     if (atm.size() > longest.size()){
         longest = atm;
     }
-    for (const auto& source : result->second.sources) {
-        path_inbeam_recursive(source, atm, longest);
+    for (Row source = beacons.first_source(row); source != NO_ROW; source = beacons.next_source(source)) {
+        inbeam_path_recursive(beacons, source, atm, longest);
     }
 
 }
 
-Color Datastructures::total_color(BeaconID id)
+std::vector<BeaconID> inbeam_path_longest(BeaconStore const& beacons, BeaconID const& id)
 {
-    auto result = beacons_.find(id);
-    if (result == beacons_.end()) {
-        return NO_COLOR;
+    Row row = beacons.find(id);
+    if (row == NO_ROW) {
+        return {{NO_ID}};
     }
-    Color color = beacons_.at(id).color;
-    const auto& sources = beacons_.at(id).sources;
-    if (sources.size() > 0) {
+    std::deque<BeaconID> atm;
+    std::deque<BeaconID> longest;
+    inbeam_path_recursive(beacons, row, atm, longest);
+    std::vector<BeaconID> longest_vector(longest.begin(), longest.end());
+    return longest_vector;
+
+}
+
+Color total_color_recursive(BeaconStore const& beacons, Row row, unsigned long depth)
+{
+    DS_MAX(max_depth, depth);
+    Color color = beacons.color(row);
+    if (beacons.first_source(row) != NO_ROW) {
         int r = color.r;
         int g = color.g;
         int b = color.b;
-        for (auto& source : sources) {
-            Color source_color = total_color(source);
+        int number_of_beacons = 1;
+        for (Row source = beacons.first_source(row); source != NO_ROW; source = beacons.next_source(source)) {
+            Color source_color = total_color_recursive(beacons, source, depth + 1);
             r += source_color.r;
             g += source_color.g;
             b += source_color.b;
+            ++number_of_beacons;
         }
-        int number_of_beacons = static_cast<int>(sources.size()) + 1;
         color = { r / number_of_beacons,
                   g / number_of_beacons,
                   b / number_of_beacons };
@@ -322,313 +337,3028 @@ Color Datastructures::total_color(BeaconID id)
     return color;
 }
 
-int Datastructures::get_brightness(Color color)
+Color beacon_total_color(BeaconStore const& beacons, BeaconID const& id)
 {
-    return 3 * color.r + 6 * color.g + color.b;
+    Row row = beacons.find(id);
+    if (row == NO_ROW) {
+        return NO_COLOR;
+    }
+    return total_color_recursive(beacons, row, 1);
 }
 
-std::vector<Coord> Datastructures::all_xpoints()
+}
+
+void TreapForest::push_back()
 {
-    std::vector<Coord> all_xpoints = {};
-    for (const auto& xpoint : xpoints_) {
-        all_xpoints.push_back(xpoint.first);
-    }
-    std::sort(all_xpoints.begin(), all_xpoints.end());
-    return all_xpoints;
+    links_.push_back(Links());
 }
 
-bool Datastructures::add_fibre(Coord xpoint1, Coord xpoint2, Cost cost)
+void TreapForest::reset(Node node)
 {
-    if (xpoint1 == xpoint2) {
-        return false;
-    }
-    auto result1 = xpoints_.find(xpoint1);
-    auto result2 = xpoints_.find(xpoint2);
+    links_.set(node, Links());
+}
 
-    if (result1 == xpoints_.end()) {
-        Xpoint new_xpoint = {xpoint1};
-        auto new_ptr = std::make_shared<Xpoint>(new_xpoint);
-        xpoints_[xpoint1] = new_ptr;
-    }
-    if (result2 == xpoints_.end()) {
-        Xpoint new_xpoint = {xpoint2};
-        auto new_ptr = std::make_shared<Xpoint>(new_xpoint);
-        xpoints_[xpoint2] = new_ptr;
-    }
-    auto& xp1 = xpoints_.at(xpoint1);
-    auto& xp2 = xpoints_.at(xpoint2);
+void TreapForest::clear()
+{
+    links_.clear();
+}
 
-    if (xp1->fibres.find(xpoint2) != xp1->fibres.end()){
-        return false;
+TreapForest::Node TreapForest::root(Node node) const
+{
+    while (links_[node].parent != NO_NODE) {
+        node = links_[node].parent;
     }
-    xp1->fibres[xpoint2] = { xp2, cost };
-    xp2->fibres[xpoint1] = { xp1, cost };
+    return node;
+}
 
-    if(xpoint1 < xpoint2){
-        fibres_.insert({xpoint1, xpoint2});
-    } else {
-        fibres_.insert({xpoint2, xpoint1});
+std::size_t TreapForest::position(Node node) const
+{
+    std::size_t position = size(links_[node].left);
+    for (Node parent = links_[node].parent; parent != NO_NODE; node = parent, parent = links_[parent].parent) {
+        if (links_[parent].right == node) {
+            position += size(links_[parent].left) + 1;
+        }
     }
-    return true;
+    return position;
 }
 
-std::vector<std::pair<Coord, Cost> > Datastructures::get_fibres_from(Coord xpoint)
+TreapForest::Node TreapForest::first(Node root) const
 {
-    if (xpoints_.find(xpoint) == xpoints_.end()) {
-        return {};
-    }
-    auto& xp = xpoints_.at(xpoint);
-    if (xp->fibres.size() == 0) {
-        return {};
-    }
-    std::vector<std::pair<Coord, Cost>> fibres_from;
-    for(const auto& fibre : xp->fibres) {
-        fibres_from.push_back({fibre.first, fibre.second.second});
+    if (root != NO_NODE) {
+        while (links_[root].left != NO_NODE) {
+            root = links_[root].left;
+        }
     }
-    std::sort(fibres_from.begin(), fibres_from.end());
-    return fibres_from;
+    return root;
 }
 
-std::vector<std::pair<Coord, Coord> > Datastructures::all_fibres()
+TreapForest::Node TreapForest::last(Node root) const
 {
-    std::vector<std::pair<Coord, Coord>> fibres;
-    for(const auto& fibre : fibres_) {
-        fibres.push_back({fibre.first, fibre.second});
+    if (root != NO_NODE) {
+        while (links_[root].right != NO_NODE) {
+            root = links_[root].right;
+        }
     }
-    return fibres;
+    return root;
 }
 
-bool Datastructures::remove_fibre(Coord xpoint1, Coord xpoint2)
+TreapForest::Node TreapForest::next(Node node) const
 {
-    auto result1 = xpoints_.find(xpoint1);
-    auto result2 = xpoints_.find(xpoint2);
-    if ((result1 == xpoints_.end()) or (result2 == xpoints_.end())){
-        return false;
+    if (links_[node].right != NO_NODE) {
+        return first(links_[node].right);
     }
-    auto fibre1 = result1->second->fibres.find(xpoint2);
-    auto fibre2 = result2->second->fibres.find(xpoint1);
-    if ((fibre1 == result1->second->fibres.end()) or
-            (fibre2 == result2->second->fibres.end())){
-        return false;
-    } else {
-        result1->second->fibres.erase(fibre1);
-        result2->second->fibres.erase(fibre2);
+    Node parent = links_[node].parent;
+    while (parent != NO_NODE and links_[parent].right == node) {
+        node = parent;
+        parent = links_[parent].parent;
     }
-    if (result1->second->fibres.empty()){
-        xpoints_.erase(result1);
+    return parent;
+}
+
+// Both parts of a split, and the result of a merge, are roots with no parent
+std::pair<TreapForest::Node, TreapForest::Node> TreapForest::split(Node root, std::size_t count)
+{
+    if (root == NO_NODE) {
+        return {NO_NODE, NO_NODE};
     }
-    if (result2->second->fibres.empty()){
-        xpoints_.erase(result2);
+    links_.mutate(root).parent = NO_NODE;
+    std::size_t left_size = size(links_[root].left);
+    if (count <= left_size) {
+        auto [first, rest] = split(links_[root].left, count);
+        links_.mutate(root).left = rest;
+        if (rest != NO_NODE) {
+            links_.mutate(rest).parent = root;
+        }
+        update(root);
+        return {first, root};
     }
-    std::pair<Coord, Coord> to_be_removed;
-    if (xpoint1 < xpoint2) {
-        to_be_removed = {xpoint1, xpoint2};
-    } else {
-        to_be_removed = {xpoint2, xpoint1};
+    auto [first, rest] = split(links_[root].right, count - left_size - 1);
+    links_.mutate(root).right = first;
+    if (first != NO_NODE) {
+        links_.mutate(first).parent = root;
     }
-    auto result = fibres_.find(to_be_removed);
-    fibres_.erase(result);
-    return true;
+    update(root);
+    return {root, rest};
 }
 
-void Datastructures::clear_fibres()
+TreapForest::Node TreapForest::merge(Node left, Node right)
 {
-    xpoints_.clear();
-    fibres_.clear();
+    if (left == NO_NODE) {
+        return right;
+    } else if (right == NO_NODE) {
+        return left;
+    }
+    if (priority(left) >= priority(right)) {
+        Node merged = merge(links_[left].right, right);
+        links_.mutate(left).right = merged;
+        links_.mutate(merged).parent = left;
+        update(left);
+        return left;
+    }
+    Node merged = merge(left, links_[right].left);
+    links_.mutate(right).left = merged;
+    links_.mutate(merged).parent = right;
+    update(right);
+    return right;
 }
 
-void Datastructures::reset_xpoints() {
-    for(auto& xpoint : xpoints_){
-        xpoint.second->state = WHITE;
-        xpoint.second->pi = nullptr;
-        xpoint.second->d = INT_MAX;
-        xpoint.second->route_cost = 0;
+TreapForest::Node TreapForest::build(std::vector<Node> const& nodes)
+{
+    // The right spine of the treap built so far, from the root down
+    std::vector<Node> spine;
+    for (Node node : nodes) {
+        reset(node);
+        Node popped = NO_NODE;
+        while (!spine.empty() and priority(spine.back()) < priority(node)) {
+            popped = spine.back();
+            spine.pop_back();
+        }
+        if (popped != NO_NODE) {
+            links_.mutate(node).left = popped;
+            links_.mutate(popped).parent = node;
+        }
+        if (!spine.empty()) {
+            links_.mutate(spine.back()).right = node;
+            links_.mutate(node).parent = spine.back();
+        }
+        spine.push_back(node);
     }
+    if (spine.empty()) {
+        return NO_NODE;
+    }
+    update_sizes(spine.front());
+    return spine.front();
 }
 
-std::vector<std::pair<Coord, Cost> > Datastructures::route_any(Coord fromxpoint, Coord toxpoint)
+TreapForest::Node TreapForest::erase(Node root, Node node)
 {
-    auto result1 = xpoints_.find(fromxpoint);
-    auto result2 = xpoints_.find(toxpoint);
-    if ((result1 == xpoints_.end()) or (result2 == xpoints_.end())){
-        return {};
+    Links links = links_[node];
+    Node merged = merge(links.left, links.right);
+    if (merged != NO_NODE) {
+        links_.mutate(merged).parent = links.parent;
     }
-    std::pair<std::shared_ptr<Xpoint>, std::shared_ptr<Xpoint>> cycle_pair = { nullptr, nullptr };
-    if (!DFS(xpoints_.at(fromxpoint), xpoints_.at(toxpoint), false, cycle_pair)){
-        return {};
+    reset(node);
+    if (links.parent == NO_NODE) {
+        return merged;
     }
-    std::vector<std::pair<Coord, Cost>> route;
-    collect_route(route, xpoints_.at(toxpoint));
-    return route;
+    if (links_[links.parent].left == node) {
+        links_.mutate(links.parent).left = merged;
+    } else {
+        links_.mutate(links.parent).right = merged;
+    }
+    for (Node ancestor = links.parent; ancestor != NO_NODE; ancestor = links_[ancestor].parent) {
+        links_.mutate(ancestor).size -= 1;
+    }
+    return root;
 }
 
-bool Datastructures::DFS(std::shared_ptr<Xpoint> from, std::shared_ptr<Xpoint> to, bool find_cycle, std::pair<std::shared_ptr<Xpoint>, std::shared_ptr<Xpoint>>& cycle_begin)
+std::uint32_t TreapForest::update_sizes(Node root)
 {
-    reset_xpoints();
-    std::stack<std::shared_ptr<Xpoint>> stack;
-    stack.push(from);
-
-    while (!stack.empty()) {
-        std::shared_ptr<Xpoint> u = stack.top();
-        stack.pop();
-        if (u->state == WHITE) {
-            u->state = GRAY;
-            stack.push(u);
-            for(auto& fibre : u->fibres) {
-                auto& v = fibre.second.first;
-                if (v->state == WHITE){
-                    v->pi = u;
-                    v->route_cost = u->route_cost + fibre.second.second;
-                    if (v == to){
-                        return true;
-                    }
-                    stack.push(v);
-                } else if (v->state == GRAY){
-                    if (find_cycle and v != u->pi){
-                        cycle_begin.first = u;
-                        cycle_begin.second = v;
-                        return true;
-                    }
-                }
-            }
-        } else {
-            u->state = BLACK;
-        }
+    if (root == NO_NODE) {
+        return 0;
     }
-    return false;
+    std::uint32_t size = 1 + update_sizes(links_[root].left) + update_sizes(links_[root].right);
+    links_.mutate(root).size = size;
+    return size;
 }
 
-void Datastructures::BFS(std::shared_ptr<Xpoint> from)
+std::size_t TreapForest::memory_bytes() const
 {
-    reset_xpoints();
-    std::queue<std::shared_ptr<Xpoint>> queue;
-
-    from->state = GRAY;
-    from->d = 0;
-    queue.push(from);
+    return links_.memory_bytes();
+}
 
-    while (!queue.empty()) {
-        std::shared_ptr<Xpoint> u = queue.front();
-        queue.pop();
-        for(auto& fibre : u->fibres) {
-            auto& v = fibre.second.first;
-            if (v->state == WHITE){
-                v->state = GRAY;
-                v->pi = u;
-                v->route_cost = u->route_cost + fibre.second.second;
-                queue.push(v);
-            }
-        }
-        u->state = BLACK;
-    }
+// Priorities are a hash of the node, so they need no column of their own
+std::uint32_t TreapForest::priority(Node node)
+{
+    node ^= node >> 16;
+    node *= 0x85ebca6b;
+    node ^= node >> 13;
+    node *= 0xc2b2ae35;
+    node ^= node >> 16;
+    return node;
 }
 
-std::vector<std::pair<Coord, Cost>> Datastructures::route_least_xpoints(Coord fromxpoint, Coord toxpoint)
+void TreapForest::attach(Node node, Node left, Node right)
 {
-    auto result1 = xpoints_.find(fromxpoint);
-    auto result2 = xpoints_.find(toxpoint);
-    if ((result1 == xpoints_.end()) or (result2 == xpoints_.end())){
-        return {};
+    auto& links = links_.mutate(node);
+    links.left = left;
+    links.right = right;
+    if (left != NO_NODE) {
+        links_.mutate(left).parent = node;
+    }
+    if (right != NO_NODE) {
+        links_.mutate(right).parent = node;
     }
+    update(node);
+}
 
-    BFS(xpoints_.at(fromxpoint));
+void TreapForest::update(Node node)
+{
+    auto size = static_cast<std::uint32_t>(1 + this->size(links_[node].left) + this->size(links_[node].right));
+    links_.mutate(node).size = size;
+}
 
-    if (xpoints_.at(toxpoint)->pi == nullptr){
-        return {};
+Row BeaconStore::add(BeaconID const& id, std::string_view name, Coord xy, Color color, int brightness)
+{
+    Row row = add_unordered(id, name, xy, color, brightness);
+    if (row == NO_ROW) {
+        return NO_ROW;
     }
-    std::vector<std::pair<Coord, Cost>> route;
-    collect_route(route, xpoints_.at(toxpoint));
-    return route;
+    insert_sorted(name_order_, name_root_, row, [this](Row lhs, Row rhs) { return name_less(lhs, rhs); });
+    insert_sorted(brightness_order_, brightness_root_, row,
+                  [this](Row lhs, Row rhs) { return brightness_less(lhs, rhs); });
+    update_brightness_ends();
+    return row;
 }
 
-void Datastructures::collect_route(std::vector<std::pair<Coord, Cost>>& route, std::shared_ptr<Xpoint> to)
+std::vector<Row> BeaconStore::add_all(std::vector<NewBeacon> const& beacons)
 {
-    std::shared_ptr<Xpoint> ptr = to;
-    while (ptr != nullptr) {
-        route.push_back({ptr->coords, ptr->route_cost});
-        ptr = ptr->pi;
+    std::vector<Row> rows;
+    rows.reserve(beacons.size());
+    if (!rebuild_is_cheaper(beacons.size(), size() + beacons.size())) {
+        for (auto const& beacon : beacons) {
+            rows.push_back(add(beacon.id, beacon.name, beacon.xy, beacon.color, beacon.brightness));
+        }
+        return rows;
     }
-    std::reverse(route.begin(), route.end());
+    reserve(size() + beacons.size());
+    for (auto const& beacon : beacons) {
+        rows.push_back(add_unordered(beacon.id, beacon.name, beacon.xy, beacon.color, beacon.brightness));
+    }
+    build_name_order();
+    build_brightness_order();
+    return rows;
 }
 
-std::vector<std::pair<Coord, Cost>> Datastructures::route_fastest(Coord fromxpoint, Coord toxpoint)
+Row BeaconStore::add_unordered(BeaconID const& id, std::string_view name, Coord xy, Color color, int brightness)
 {
-    auto result1 = xpoints_.find(fromxpoint);
-    auto result2 = xpoints_.find(toxpoint);
-    if ((result1 == xpoints_.end()) or (result2 == xpoints_.end())){
-        return {};
+    if (find(id) != NO_ROW) {
+        return NO_ROW;
     }
-    dijkstra(xpoints_.at(fromxpoint));
-
-    if (xpoints_.at(toxpoint)->pi == nullptr){
-        return {};
+    Row row = free_rows_;
+    if (row != NO_ROW) {
+        free_rows_ = next_source_[row];
+        next_source_.set(row, NO_ROW);
+        tour_.reset(enter_token(row));
+        tour_.reset(exit_token(row));
+    } else {
+        row = end();
+        ids_.push_back({});
+        names_.push_back({});
+        coords_.push_back(NO_COORD);
+        colors_.push_back(FREE_ROW_COLOR);
+        brightness_.push_back(NO_VALUE);
+        target_.push_back(NO_ROW);
+        first_source_.push_back(NO_ROW);
+        next_source_.push_back(NO_ROW);
+        tour_.push_back();
+        tour_.push_back();
+        name_order_.push_back();
+        brightness_order_.push_back();
     }
+    // A beacon without lightbeams is a tour of its own, enter then exit
+    tour_.merge(enter_token(row), exit_token(row));
+    ids_.set(row, id);
+    id_index_.insert(row, [this](Row other) { return hash_of(other); });
+    names_.set(row, std::string(name));
+    coords_.set(row, xy);
+    colors_.set(row, pack_color(color));
+    brightness_.set(row, brightness);
+    return row;
+}
 
-    std::vector<std::pair<Coord, Cost>> route;
-    collect_route(route, xpoints_.at(toxpoint));
-    return route;
+void BeaconStore::remove(Row row)
+{
+    erase_node(name_order_, name_root_, row);
+    erase_node(brightness_order_, brightness_root_, row);
+    update_brightness_ends();
+    id_index_.erase(row, [this](Row other) { return hash_of(other); });
+    ids_.set(row, {});
+    names_.set(row, {});
+    colors_.set(row, FREE_ROW_COLOR);
+    brightness_.set(row, NO_VALUE);
+    next_source_.set(row, free_rows_);
+    free_rows_ = row;
 }
 
-void Datastructures::dijkstra(std::shared_ptr<Xpoint> from)
+void BeaconStore::clear()
 {
-    reset_xpoints();
-    std::priority_queue<std::shared_ptr<Xpoint>, std::vector<std::shared_ptr<Xpoint>>, Prio_que_op> min_queue;
+    *this = BeaconStore();
+}
 
-    from->state = GRAY;
-    from->d = 0;
-    min_queue.push(from);
+void BeaconStore::reserve(std::size_t n)
+{
+    id_index_.reserve(n, [this](Row other) { return hash_of(other); });
+}
 
-    while (!min_queue.empty()){
-        std::shared_ptr<Xpoint> u = min_queue.top();
-        min_queue.pop();
-        for(auto& fibre : u->fibres) {
-            auto& v = fibre.second.first;
-            relax(u, v, fibre.second.second);
-            if (v->state == WHITE){
-                v->state = GRAY;
-                min_queue.push(v);
-            }  
-        }
-        u->state = BLACK;
-    }
+void BeaconStore::set_name(Row row, std::string_view name)
+{
+    erase_node(name_order_, name_root_, row);
+    names_.set(row, std::string(name));
+    insert_sorted(name_order_, name_root_, row, [this](Row lhs, Row rhs) { return name_less(lhs, rhs); });
 }
 
-void Datastructures::relax(std::shared_ptr<Xpoint> u, std::shared_ptr<Xpoint> v, Cost w)
+void BeaconStore::set_color(Row row, Color color, int brightness)
 {
-    if (v->d > u->d + w) {
-        v->d = u->d + w;
-        v->pi = u;
-        v->route_cost = u->route_cost + w;
-    }
+    erase_node(brightness_order_, brightness_root_, row);
+    colors_.set(row, pack_color(color));
+    brightness_.set(row, brightness);
+    insert_sorted(brightness_order_, brightness_root_, row,
+                  [this](Row lhs, Row rhs) { return brightness_less(lhs, rhs); });
+    update_brightness_ends();
 }
 
-std::vector<Coord> Datastructures::route_fibre_cycle(Coord startxpoint)
+void BeaconStore::set_names(std::vector<std::pair<Row, std::string>> const& changes)
 {
-    auto result = xpoints_.find(startxpoint);
-    if (result == xpoints_.end()){
-        return {};
+    if (!rebuild_is_cheaper(changes.size(), size())) {
+        for (const auto& change : changes) {
+            set_name(change.first, change.second);
+        }
+        return;
     }
-
-    std::pair<std::shared_ptr<Xpoint>, std::shared_ptr<Xpoint>> cycle_pair = { nullptr, nullptr };
-    if (!DFS(xpoints_.at(startxpoint), nullptr, true, cycle_pair)){
-        return {};
+    for (const auto& change : changes) {
+        names_.set(change.first, change.second);
     }
+    build_name_order();
+}
 
-    std::vector<Coord> route;
-    route.push_back(cycle_pair.second->coords);
-    std::shared_ptr<Xpoint> ptr = cycle_pair.first;
-    while (ptr != nullptr) {
-        route.push_back(ptr->coords);
-        if (ptr->coords == route.at(0)) {
-            break;
+void BeaconStore::set_colors(std::vector<ColorChange> const& changes)
+{
+    if (!rebuild_is_cheaper(changes.size(), size())) {
+        for (const auto& change : changes) {
+            set_color(change.row, change.color, change.brightness);
         }
-        ptr = ptr->pi;
+        return;
     }
-    return route;
+    for (const auto& change : changes) {
+        colors_.set(change.row, pack_color(change.color));
+        brightness_.set(change.row, change.brightness);
+    }
+    build_brightness_order();
+}
+
+Row BeaconStore::lower_bound_name(std::string_view name) const
+{
+    return name_order_.lower_bound(name_root_, [&](Row row) { return std::string_view(names_[row]) < name; });
+}
+
+bool BeaconStore::name_less(Row lhs, Row rhs) const
+{
+    auto const& lhs_name = names_[lhs];
+    auto const& rhs_name = names_[rhs];
+    return lhs_name < rhs_name or (lhs_name == rhs_name and lhs < rhs);
+}
+
+bool BeaconStore::brightness_less(Row lhs, Row rhs) const
+{
+    return brightness_[lhs] < brightness_[rhs] or (brightness_[lhs] == brightness_[rhs] and lhs < rhs);
+}
+
+void BeaconStore::build_name_order()
+{
+    std::vector<Row> rows;
+    rows.reserve(size());
+    for (Row row = 0; row < end(); ++row) {
+        if (alive(row)) {
+            rows.push_back(row);
+        }
+    }
+    std::sort(rows.begin(), rows.end(), [this](Row lhs, Row rhs) { return name_less(lhs, rhs); });
+    name_root_ = name_order_.build(rows);
+}
+
+void BeaconStore::build_brightness_order()
+{
+    std::vector<Row> rows;
+    rows.reserve(size());
+    for (Row row = 0; row < end(); ++row) {
+        if (alive(row)) {
+            rows.push_back(row);
+        }
+    }
+    std::sort(rows.begin(), rows.end(), [this](Row lhs, Row rhs) { return brightness_less(lhs, rhs); });
+    brightness_root_ = brightness_order_.build(rows);
+    update_brightness_ends();
+}
+
+void BeaconStore::update_brightness_ends()
+{
+    dimmest_ = brightness_order_.first(brightness_root_);
+    brightest_ = brightness_order_.last(brightness_root_);
+}
+
+void BeaconStore::link(Row source, Row target)
+{
+    target_.set(source, target);
+    Row previous = NO_ROW;
+    Row next = first_source_[target];
+    while (next != NO_ROW and ids_[next] < ids_[source]) {
+        previous = next;
+        next = next_source_[next];
+    }
+    next_source_.set(source, next);
+    if (previous == NO_ROW) {
+        first_source_.set(target, source);
+    } else {
+        next_source_.set(previous, source);
+    }
+
+    // The tour of the source's tree goes right after the target's enter token
+    Token source_tour = tour_.root(enter_token(source));
+    auto [before, after] = tour_.split(tour_.root(enter_token(target)), tour_.position(enter_token(target)) + 1);
+    tour_.merge(tour_.merge(before, source_tour), after);
+}
+
+std::size_t BeaconStore::unlink(Row source)
+{
+    Row target = target_[source];
+    std::size_t walked = 1;
+    Row previous = NO_ROW;
+    Row next = first_source_[target];
+    while (next != source) {
+        previous = next;
+        next = next_source_[next];
+        ++walked;
+    }
+    if (previous == NO_ROW) {
+        first_source_.set(target, next_source_[source]);
+    } else {
+        next_source_.set(previous, next_source_[source]);
+    }
+    next_source_.set(source, NO_ROW);
+    target_.set(source, NO_ROW);
+
+    // Cut the tour of the source's subtree out of the target's tour
+    std::size_t first = tour_.position(enter_token(source));
+    std::size_t last = tour_.position(exit_token(source));
+    auto [through_subtree, after] = tour_.split(tour_.root(enter_token(source)), last + 1);
+    auto [before, subtree] = tour_.split(through_subtree, first);
+    tour_.merge(before, after);
+    return walked;
+}
+
+bool BeaconStore::is_upstream(Row upstream, Row downstream) const
+{
+    if (upstream == downstream or tour_.root(enter_token(upstream)) != tour_.root(enter_token(downstream))) {
+        return false;
+    }
+    std::size_t position = tour_.position(enter_token(upstream));
+    return tour_.position(enter_token(downstream)) < position and position < tour_.position(exit_token(downstream));
+}
+
+std::size_t BeaconStore::upstream_count(Row row) const
+{
+    return (tour_.position(exit_token(row)) - tour_.position(enter_token(row)) - 1) / 2;
+}
+
+void BeaconStore::upstream_rows(Row row, std::vector<Row>& rows) const
+{
+    for (Token token = tour_.next(enter_token(row)); token != exit_token(row); token = tour_.next(token)) {
+        if (token % 2 == 0) {
+            rows.push_back(token / 2);
+        }
+    }
+}
+
+void BeaconStore::memory_usage(MemoryUsage& usage) const
+{
+    usage["beacon ids"] = id_index_.memory_bytes() + ids_.memory_bytes() + string_heap_bytes(ids_);
+    usage["beacon names"] = names_.memory_bytes() + string_heap_bytes(names_);
+    usage["beacon columns"] = coords_.memory_bytes() + colors_.memory_bytes() + brightness_.memory_bytes()
+            + target_.memory_bytes() + first_source_.memory_bytes() + next_source_.memory_bytes();
+    usage["beacon orders"] = name_order_.memory_bytes() + brightness_order_.memory_bytes();
+    usage["lightbeam index"] = tour_.memory_bytes();
+}
+
+// ---------------------------- Beacons ---------------------------------------
+
+Datastructures::Datastructures() :
+    beacons_()
+{
+    publish();
+}
+
+Datastructures::~Datastructures()
+{
+}
+
+int Datastructures::beacon_count()
+{
+    DS_TIME_OPERATION();
+    return static_cast<int>(beacons_.size());
+}
+
+void Datastructures::clear_beacons()
+{
+    DS_TIME_OPERATION();
+    if (batch_.open) {
+        batch_reject();
+        return;
+    }
+    beacons_.clear();
+    published_beacons_.reset();
+}
+
+
+std::vector<BeaconID> Datastructures::all_beacons()
+{
+    DS_TIME_OPERATION();
+    return ids_in_row_order(beacons_);
+}
+
+bool Datastructures::add_beacon(BeaconID id, const std::string& name, Coord xy, Color color)
+{
+    DS_TIME_OPERATION();
+    if (batch_.open) {
+        return batch_reject();
+    }
+    if (!is_packable(color)) {
+        return false;
+    }
+    int new_beacon_brightness = get_brightness(color);
+    Row row = beacons_.add(id, name, xy, color, new_beacon_brightness);
+    if (row == NO_ROW) {
+        return false;
+    }
+    published_beacons_.reset();
+    return true;
+}
+
+std::string Datastructures::get_name(BeaconID id)
+{
+    DS_TIME_OPERATION();
+    return beacon_name(beacons_, id);
+}
+
+Coord Datastructures::get_coordinates(BeaconID id)
+{
+    DS_TIME_OPERATION();
+    return beacon_coordinates(beacons_, id);
+}
+
+Color Datastructures::get_color(BeaconID id)
+{
+    DS_TIME_OPERATION();
+    return beacon_color(beacons_, id);
+}
+
+
+std::vector<BeaconID> Datastructures::beacons_alphabetically()
+{
+    DS_TIME_OPERATION();
+    return ids_by_name(beacons_);
+}
+
+std::vector<BeaconID> Datastructures::beacons_brightness_increasing()
+{
+    DS_TIME_OPERATION();
+    return ids_by_brightness(beacons_);
+}
+
+BeaconID Datastructures::min_brightness()
+{
+    DS_TIME_OPERATION();
+    return id_or_none(beacons_, beacons_.first_by_brightness());
+}
+
+BeaconID Datastructures::max_brightness()
+{
+    DS_TIME_OPERATION();
+    return id_or_none(beacons_, beacons_.last_by_brightness());
+}
+
+std::vector<BeaconID> Datastructures::find_beacons(std::string const& name)
+{
+    DS_TIME_OPERATION();
+    return ids_named(beacons_, name);
+}
+
+bool Datastructures::change_beacon_name(BeaconID id, const std::string& newname)
+{
+    DS_TIME_OPERATION();
+    Row row = beacons_.find(id);
+    if (row == NO_ROW) {
+        return batch_reject();
+    }
+    if (batch_.open) {
+        batch_.names[id] = newname;
+        return true;
+    }
+    published_beacons_.reset();
+    beacons_.set_name(row, newname);
+    return true;
+}
+
+bool Datastructures::change_beacon_color(BeaconID id, Color newcolor)
+{
+    DS_TIME_OPERATION();
+    Row row = beacons_.find(id);
+    if (row == NO_ROW or !is_packable(newcolor)) {
+        return batch_reject();
+    }
+    if (batch_.open) {
+        batch_.colors[id] = newcolor;
+        return true;
+    }
+    published_beacons_.reset();
+    beacons_.set_color(row, newcolor, get_brightness(newcolor));
+    return true;
+}
+
+
+bool Datastructures::add_lightbeam(BeaconID sourceid, BeaconID targetid)
+{
+    DS_TIME_OPERATION();
+    Row source = beacons_.find(sourceid);
+    Row target = beacons_.find(targetid);
+    if (source == NO_ROW or target == NO_ROW) {
+        return batch_reject();
+    } else if (beacons_.target(source) != NO_ROW or batch_.new_sources.count(sourceid) != 0) {
+        return batch_reject();
+    } else if (source == target or beacons_.is_upstream(target, source)) {
+        // The lightbeam would close a loop
+        return batch_reject();
+    }
+    if (batch_.open) {
+        batch_.lightbeams.push_back({sourceid, targetid});
+        batch_.new_sources.insert(sourceid);
+        return true;
+    }
+    beacons_.link(source, target);
+    published_beacons_.reset();
+    return true;
+}
+
+std::vector<BeaconID> Datastructures::get_lightsources(BeaconID id)
+{
+    DS_TIME_OPERATION();
+    return lightsources(beacons_, id);
+}
+
+std::vector<BeaconID> Datastructures::get_all_lightsources(BeaconID id)
+{
+    DS_TIME_OPERATION();
+    return all_lightsources(beacons_, id);
+}
+
+int Datastructures::count_all_lightsources(BeaconID id)
+{
+    DS_TIME_OPERATION();
+    return all_lightsources_count(beacons_, id);
+}
+
+bool Datastructures::is_upstream(BeaconID upstreamid, BeaconID downstreamid)
+{
+    DS_TIME_OPERATION();
+    return upstream(beacons_, upstreamid, downstreamid);
+}
+
+std::vector<BeaconID> Datastructures::path_outbeam(BeaconID id)
+{
+    DS_TIME_OPERATION();
+    return outbeam_path(beacons_, id);
+}
+
+bool Datastructures::remove_beacon(BeaconID id)
+{
+    DS_TIME_OPERATION();
+    if (batch_.open) {
+        return batch_reject();
+    }
+    Row row = beacons_.find(id);
+    if (row == NO_ROW) {
+        return false;
+    }
+    std::size_t walked = 0;
+    if (beacons_.target(row) != NO_ROW) {
+        walked += beacons_.unlink(row);
+    }
+    while (beacons_.first_source(row) != NO_ROW) {
+        walked += beacons_.unlink(beacons_.first_source(row));
+    }
+    DS_COUNT(entries_scanned, walked);
+    beacons_.remove(row);
+    published_beacons_.reset();
+    return true;
+}
+
+std::vector<BeaconID> Datastructures::path_inbeam_longest(BeaconID id)
+{
+    DS_TIME_OPERATION();
+    return inbeam_path_longest(beacons_, id);
+}
+
+Color Datastructures::total_color(BeaconID id)
+{
+    DS_TIME_OPERATION();
+    return beacon_total_color(beacons_, id);
+}
+
+int Datastructures::get_brightness(Color color)
+{
+    return 3 * color.r + 6 * color.g + color.b;
+}
+
+MemoryUsage Datastructures::memory_usage()
+{
+    DS_TIME_OPERATION();
+    MemoryUsage usage;
+    beacons_.memory_usage(usage);
+    usage["xpoints"] = xpoints_.memory_bytes();
+    usage["fibres"] = fibres_.size() * set_node_bytes<std::pair<Coord, Coord>>();
+    spatial_.memory_usage(usage);
+    std::size_t hub_bytes = hash_table_bytes(hub_trees_);
+    for (const auto& hub : hub_trees_) {
+        hub_bytes += hash_table_bytes(hub.second);
+    }
+    usage["hub trees"] = hub_bytes;
+
+    std::size_t total = 0;
+    for (const auto& structure : usage) {
+        total += structure.second;
+    }
+    usage["total"] = total;
+    return usage;
+}
+
+// ---------------------------- Color queries ---------------------------------
+
+namespace {
+
+// Squared color distance of a free row
+std::uint32_t const FREE_ROW_DISTANCE = std::numeric_limits<std::uint32_t>::max();
+
+std::uint32_t color_distance(std::uint32_t packed, Color target)
+{
+    if ((packed & FREE_ROW_COLOR) != 0) {
+        return FREE_ROW_DISTANCE;
+    }
+    Color color = unpack_color(packed);
+    int dr = color.r - target.r;
+    int dg = color.g - target.g;
+    int db = color.b - target.b;
+    return static_cast<std::uint32_t>(dr * dr + dg * dg + db * db);
+}
+
+// Writes the squared distance of n packed colors to target into out. Uses
+// AVX2 or SSE2 when the compiler targets them, the scalar loop handles the rest.
+void color_distances(std::uint32_t const* colors, std::size_t n, Color target, std::uint32_t* out)
+{
+    std::size_t i = 0;
+    // The differences fit in 16 bits, so madd of the low halves squares them,
+    // which is cheaper than a 32-bit multiply
+#if defined(__AVX2__)
+    const __m256i byte_mask = _mm256_set1_epi32(0xff);
+    const __m256i low_half = _mm256_set1_epi32(0xffff);
+    const __m256i free_mask = _mm256_set1_epi32(static_cast<int>(FREE_ROW_COLOR));
+    const __m256i target_r = _mm256_set1_epi32(target.r);
+    const __m256i target_g = _mm256_set1_epi32(target.g);
+    const __m256i target_b = _mm256_set1_epi32(target.b);
+    for (; i + 8 <= n; i += 8) {
+        __m256i c = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(colors + i));
+        __m256i dr = _mm256_and_si256(_mm256_sub_epi32(_mm256_and_si256(_mm256_srli_epi32(c, 16), byte_mask), target_r), low_half);
+        __m256i dg = _mm256_and_si256(_mm256_sub_epi32(_mm256_and_si256(_mm256_srli_epi32(c, 8), byte_mask), target_g), low_half);
+        __m256i db = _mm256_and_si256(_mm256_sub_epi32(_mm256_and_si256(c, byte_mask), target_b), low_half);
+        __m256i d = _mm256_add_epi32(_mm256_add_epi32(_mm256_madd_epi16(dr, dr), _mm256_madd_epi16(dg, dg)),
+                                     _mm256_madd_epi16(db, db));
+        __m256i is_free = _mm256_cmpeq_epi32(_mm256_and_si256(c, free_mask), free_mask);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_or_si256(d, is_free));
+    }
+#elif defined(__SSE2__)
+    const __m128i byte_mask = _mm_set1_epi32(0xff);
+    const __m128i low_half = _mm_set1_epi32(0xffff);
+    const __m128i free_mask = _mm_set1_epi32(static_cast<int>(FREE_ROW_COLOR));
+    const __m128i target_r = _mm_set1_epi32(target.r);
+    const __m128i target_g = _mm_set1_epi32(target.g);
+    const __m128i target_b = _mm_set1_epi32(target.b);
+    for (; i + 4 <= n; i += 4) {
+        __m128i c = _mm_loadu_si128(reinterpret_cast<__m128i const*>(colors + i));
+        __m128i dr = _mm_and_si128(_mm_sub_epi32(_mm_and_si128(_mm_srli_epi32(c, 16), byte_mask), target_r), low_half);
+        __m128i dg = _mm_and_si128(_mm_sub_epi32(_mm_and_si128(_mm_srli_epi32(c, 8), byte_mask), target_g), low_half);
+        __m128i db = _mm_and_si128(_mm_sub_epi32(_mm_and_si128(c, byte_mask), target_b), low_half);
+        __m128i d = _mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(dr, dr), _mm_madd_epi16(dg, dg)),
+                                  _mm_madd_epi16(db, db));
+        __m128i is_free = _mm_cmpeq_epi32(_mm_and_si128(c, free_mask), free_mask);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_or_si128(d, is_free));
+    }
+#endif
+    for (; i < n; ++i) {
+        out[i] = color_distance(colors[i], target);
+    }
+}
+
+// Calls found(row, distance) for every beacon, page by page, so the
+// distance buffer stays in cache
+template <typename Found>
+void scan_color_distances(BeaconStore const& beacons, Color target, Found found)
+{
+    const auto& colors = beacons.packed_colors();
+    std::vector<std::uint32_t> distances(PagedColumn<std::uint32_t>::PAGE_SIZE);
+    colors.for_each_page([&](std::size_t start, std::uint32_t const* page, std::size_t n) {
+        color_distances(page, n, target, distances.data());
+        for (std::size_t i = 0; i < n; ++i) {
+            if (distances[i] != FREE_ROW_DISTANCE) {
+                found(static_cast<Row>(start + i), distances[i]);
+            }
+        }
+    });
+    DS_COUNT(entries_scanned, colors.size());
+}
+
+std::vector<BeaconID> beacons_by_color(BeaconStore const& beacons, Color target, int max_distance)
+{
+    if (!is_packable(target) or max_distance < 0) {
+        return {};
+    }
+    auto max_squared = std::min<std::uint64_t>(static_cast<std::uint64_t>(max_distance) * max_distance,
+                                               FREE_ROW_DISTANCE - 1);
+    std::vector<BeaconID> found_ids;
+    scan_color_distances(beacons, target, [&](Row row, std::uint32_t distance) {
+        if (distance <= max_squared) {
+            found_ids.push_back(beacons.id(row));
+        }
+    });
+    std::sort(found_ids.begin(), found_ids.end());
+    return found_ids;
+}
+
+std::vector<BeaconID> nearest_colors(BeaconStore const& beacons, Color target, int k)
+{
+    if (!is_packable(target) or k <= 0) {
+        return {};
+    }
+    // Max-heap of the k nearest so far, equally near ones ordered by id
+    using Candidate = std::pair<std::uint32_t, BeaconID const*>;
+    auto nearer = [](Candidate const& lhs, Candidate const& rhs) {
+        return lhs.first < rhs.first or (lhs.first == rhs.first and *lhs.second < *rhs.second);
+    };
+    std::vector<Candidate> heap;
+    heap.reserve(static_cast<std::size_t>(k) + 1);
+    scan_color_distances(beacons, target, [&](Row row, std::uint32_t distance) {
+        if (heap.size() == static_cast<std::size_t>(k) and distance > heap.front().first) {
+            return;
+        }
+        heap.push_back({distance, &beacons.id(row)});
+        std::push_heap(heap.begin(), heap.end(), nearer);
+        if (heap.size() > static_cast<std::size_t>(k)) {
+            std::pop_heap(heap.begin(), heap.end(), nearer);
+            heap.pop_back();
+        }
+    });
+    std::sort_heap(heap.begin(), heap.end(), nearer);
+    std::vector<BeaconID> ids;
+    ids.reserve(heap.size());
+    for (const auto& candidate : heap) {
+        ids.push_back(*candidate.second);
+    }
+    return ids;
+}
+
+std::vector<int> histogram_of_brightness(BeaconStore const& beacons, int buckets)
+{
+    if (buckets <= 0) {
+        return {};
+    }
+    std::vector<int> histogram(static_cast<std::size_t>(buckets), 0);
+    const auto& brightnesses = beacons.brightnesses();
+    brightnesses.for_each_page([&](std::size_t, int const* page, std::size_t n) {
+        for (std::size_t i = 0; i < n; ++i) {
+            if (page[i] != NO_VALUE) {
+                auto bucket = static_cast<long long>(page[i]) * buckets / (MAX_BRIGHTNESS + 1);
+                ++histogram[static_cast<std::size_t>(bucket)];
+            }
+        }
+    });
+    DS_COUNT(entries_scanned, brightnesses.size());
+    return histogram;
+}
+
+}
+
+std::vector<BeaconID> Datastructures::find_beacons_by_color(Color target, int max_distance)
+{
+    DS_TIME_OPERATION();
+    return beacons_by_color(beacons_, target, max_distance);
+}
+
+std::vector<BeaconID> Datastructures::nearest_color(Color target, int k)
+{
+    DS_TIME_OPERATION();
+    return nearest_colors(beacons_, target, k);
+}
+
+std::vector<int> Datastructures::brightness_histogram(int buckets)
+{
+    DS_TIME_OPERATION();
+    return histogram_of_brightness(beacons_, buckets);
+}
+
+// ---------------------------- Route searches --------------------------------
+
+// The searches keep their bookkeeping in a SearchState of their own instead
+// of in the xpoints, so they only read the network. The same functions serve
+// both Datastructures and Snapshot.
+
+namespace {
+
+std::vector<Coord> xpoint_coords(XpointMap const& xpoints)
+{
+    std::vector<Coord> all_xpoints = {};
+    all_xpoints.reserve(xpoints.size());
+    xpoints.for_each([&](Coord xy, Fibres const&) {
+        all_xpoints.push_back(xy);
+    });
+    std::sort(all_xpoints.begin(), all_xpoints.end());
+    return all_xpoints;
+}
+
+std::vector<std::pair<Coord, Cost>> fibres_from(XpointMap const& xpoints, Coord xpoint)
+{
+    auto fibres = xpoints.find(xpoint);
+    if (fibres == nullptr) {
+        return {};
+    }
+    std::vector<std::pair<Coord, Cost>> fibres_from(fibres->begin(), fibres->end());
+    std::sort(fibres_from.begin(), fibres_from.end());
+    return fibres_from;
+}
+
+// Each fibre once, the smaller xpoint first
+std::vector<std::pair<Coord, Coord>> fibre_ends(XpointMap const& xpoints)
+{
+    std::vector<std::pair<Coord, Coord>> fibres;
+    xpoints.for_each([&](Coord xy, Fibres const& fibres_from) {
+        for (const auto& fibre : fibres_from) {
+            if (xy < fibre.first) {
+                fibres.push_back({xy, fibre.first});
+            }
+        }
+    });
+    std::sort(fibres.begin(), fibres.end());
+    return fibres;
+}
+
+// Depth-first-search algorithm, which returns true if a loop is found.
+// Searches for a route use RouteSearch instead.
+bool DFS(XpointMap const& xpoints, Coord from, SearchState& state, std::pair<Coord, Coord>& cycle_begin)
+{
+    std::stack<Coord> stack;
+    stack.push(from);
+
+    while (!stack.empty()) {
+        Coord u = stack.top();
+        stack.pop();
+        // References to unordered_map elements stay valid on insertion
+        auto& u_node = state[u];
+        if (u_node.state == WHITE) {
+            u_node.state = GRAY;
+            DS_COUNT(nodes_settled, 1ul);
+            stack.push(u);
+            for (const auto& fibre : xpoints.at(u)) {
+                DS_COUNT(edges_relaxed, 1ul);
+                const auto& v = fibre.first;
+                auto& v_node = state[v];
+                if (v_node.state == WHITE){
+                    v_node.pi = u;
+                    stack.push(v);
+                } else if (v_node.state == GRAY and v != u_node.pi){
+                    cycle_begin = {u, v};
+                    return true;
+                }
+            }
+        } else {
+            u_node.state = BLACK;
+        }
+    }
+    return false;
+}
+
+// Breath-first-search algorithm
+void BFS(XpointMap const& xpoints, Coord from, SearchState& state)
+{
+    std::queue<Coord> queue;
+
+    auto& from_node = state[from];
+    from_node.state = GRAY;
+    from_node.d = 0;
+    queue.push(from);
+
+    while (!queue.empty()) {
+        Coord u = queue.front();
+        queue.pop();
+        auto& u_node = state[u];
+        const auto& fibres = xpoints.at(u);
+        DS_COUNT(nodes_settled, 1ul);
+        DS_COUNT(edges_relaxed, fibres.size());
+        for (const auto& fibre : fibres) {
+            auto& v_node = state[fibre.first];
+            if (v_node.state == WHITE){
+                v_node.state = GRAY;
+                v_node.pi = u;
+                v_node.route_cost = u_node.route_cost + fibre.second;
+                queue.push(fibre.first);
+            }
+        }
+        u_node.state = BLACK;
+    }
+}
+
+// Relax -function used in Dijkstra's. Returns true if v got a shorter distance.
+bool relax(Coord u, SearchNode const& u_node, SearchNode& v_node, Cost w)
+{
+    if (v_node.d > u_node.d + w) {
+        v_node.d = u_node.d + w;
+        v_node.pi = u;
+        v_node.route_cost = u_node.route_cost + w;
+        return true;
+    }
+    return false;
+}
+
+// Route-collecting algorithm that collects a route stored in the pi-fields
+// of a search state.
+void collect_route(std::vector<std::pair<Coord, Cost>>& route, SearchState const& state, Coord to)
+{
+    Coord xy = to;
+    while (xy != NO_COORD) {
+        const auto& node = state.at(xy);
+        route.push_back({xy, node.route_cost});
+        xy = node.pi;
+    }
+    std::reverse(route.begin(), route.end());
+}
+
+// True if the search reached xpoint from somewhere else
+bool reached(SearchState const& state, Coord xpoint)
+{
+    auto result = state.find(xpoint);
+    return result != state.end() and result->second.pi != NO_COORD;
+}
+
+using MinQueue = std::priority_queue<std::pair<Cost, Coord>, std::vector<std::pair<Cost, Coord>>, Prio_que_op>;
+
+// How many xpoints step_for() expands between looking at the clock
+std::size_t const CLOCK_CHECK_INTERVAL = 64;
+
+}
+
+// The route searches of Datastructures and Snapshot are RouteSearches run to
+// the end in one go.
+
+RouteSearch::RouteSearch(std::shared_ptr<const XpointMap> xpoints, Coord fromxpoint, Coord toxpoint, SearchKind kind) :
+    RouteSearch(*xpoints, fromxpoint, toxpoint, kind)
+{
+    owner_ = std::move(xpoints);
+}
+
+RouteSearch::RouteSearch(XpointMap const& xpoints, Coord fromxpoint, Coord toxpoint, SearchKind kind) :
+    owner_(nullptr),
+    xpoints_(&xpoints),
+    from_(fromxpoint),
+    to_(toxpoint),
+    kind_(kind),
+    status_(SEARCHING),
+    lower_bound_(0),
+    expanded_(0)
+{
+    if ((xpoints.find(fromxpoint) == nullptr) or (xpoints.find(toxpoint) == nullptr)){
+        status_ = NO_ROUTE;
+        return;
+    }
+    if (kind_ == FASTEST_ROUTE) {
+        auto& from_node = state_[from_];
+        from_node.state = GRAY;
+        from_node.d = 0;
+        min_queue_.push({0, from_});
+    } else {
+        stack_.push(from_);
+    }
+}
+
+SearchStatus RouteSearch::step(std::size_t max_xpoints)
+{
+    for (std::size_t i = 0; i < max_xpoints and status_ == SEARCHING; ++i) {
+        if (kind_ == FASTEST_ROUTE) {
+            advance_fastest();
+        } else {
+            advance_any();
+        }
+    }
+    return status_;
+}
+
+SearchStatus RouteSearch::step_for(std::chrono::microseconds budget)
+{
+    auto deadline = std::chrono::steady_clock::now() + budget;
+    while (status_ == SEARCHING) {
+        step(CLOCK_CHECK_INTERVAL);
+        if (std::chrono::steady_clock::now() >= deadline) {
+            break;
+        }
+    }
+    return status_;
+}
+
+void RouteSearch::cancel()
+{
+    if (status_ == SEARCHING) {
+        status_ = CANCELLED;
+    }
+}
+
+SearchStatus RouteSearch::status() const
+{
+    return status_;
+}
+
+bool RouteSearch::done() const
+{
+    return status_ != SEARCHING;
+}
+
+Cost RouteSearch::best_bound() const
+{
+    if (status_ == NO_ROUTE) {
+        return NO_COST;
+    }
+    if (!reached(state_, to_)) {
+        return NO_COST;
+    }
+    return state_.at(to_).route_cost;
+}
+
+Cost RouteSearch::lower_bound() const
+{
+    return lower_bound_;
+}
+
+std::size_t RouteSearch::xpoints_expanded() const
+{
+    return expanded_;
+}
+
+std::vector<std::pair<Coord, Cost>> RouteSearch::route() const
+{
+    if (status_ != ROUTE_FOUND) {
+        return {};
+    }
+    std::vector<std::pair<Coord, Cost>> route;
+    collect_route(route, state_, to_);
+    return route;
+}
+
+// One round of depth-first-search. Ends as soon as the target is discovered.
+void RouteSearch::advance_any()
+{
+    if (stack_.empty()) {
+        status_ = NO_ROUTE;
+        return;
+    }
+    Coord u = stack_.top();
+    stack_.pop();
+    // References to unordered_map elements stay valid on insertion
+    auto& u_node = state_[u];
+    if (u_node.state != WHITE) {
+        u_node.state = BLACK;
+        return;
+    }
+    u_node.state = GRAY;
+    ++expanded_;
+    DS_COUNT(nodes_settled, 1ul);
+    stack_.push(u);
+    for (const auto& fibre : xpoints_->at(u)) {
+        DS_COUNT(edges_relaxed, 1ul);
+        const auto& v = fibre.first;
+        auto& v_node = state_[v];
+        if (v_node.state == WHITE){
+            v_node.pi = u;
+            v_node.route_cost = u_node.route_cost + fibre.second;
+            if (v == to_){
+                status_ = ROUTE_FOUND;
+                return;
+            }
+            stack_.push(v);
+        }
+    }
+}
+
+// One round of Dijkstra's algorithm. Xpoints are pushed again whenever their
+// distance decreases and outdated queue entries are skipped. Ends when the
+// target is settled, its route is then the fastest one.
+void RouteSearch::advance_fastest()
+{
+    while (!min_queue_.empty()) {
+        auto [d, u] = min_queue_.top();
+        auto const& u_node = state_[u];
+        if (u_node.state != BLACK and d <= u_node.d) {
+            break;
+        }
+        min_queue_.pop();
+    }
+    if (min_queue_.empty()) {
+        status_ = NO_ROUTE;
+        return;
+    }
+    auto [d, u] = min_queue_.top();
+    min_queue_.pop();
+    lower_bound_ = d;
+    auto& u_node = state_[u];
+    u_node.state = BLACK;
+    ++expanded_;
+    if (u == to_) {
+        status_ = reached(state_, to_) ? ROUTE_FOUND : NO_ROUTE;
+        return;
+    }
+    const auto& fibres = xpoints_->at(u);
+    DS_COUNT(nodes_settled, 1ul);
+    DS_COUNT(edges_relaxed, fibres.size());
+    for (const auto& fibre : fibres) {
+        auto& v_node = state_[fibre.first];
+        if (v_node.state != BLACK and relax(u, u_node, v_node, fibre.second)) {
+            v_node.state = GRAY;
+            min_queue_.push({v_node.d, fibre.first});
+        }
+    }
+}
+
+namespace {
+
+std::vector<std::pair<Coord, Cost>> find_route(XpointMap const& xpoints, Coord fromxpoint, Coord toxpoint, SearchKind kind)
+{
+    RouteSearch search(xpoints, fromxpoint, toxpoint, kind);
+    search.step(std::numeric_limits<std::size_t>::max());
+    return search.route();
+}
+
+std::vector<std::pair<Coord, Cost>> find_route_any(XpointMap const& xpoints, Coord fromxpoint, Coord toxpoint)
+{
+    return find_route(xpoints, fromxpoint, toxpoint, ANY_ROUTE);
+}
+
+std::vector<std::pair<Coord, Cost>> find_route_least_xpoints(XpointMap const& xpoints, Coord fromxpoint, Coord toxpoint)
+{
+    if ((xpoints.find(fromxpoint) == nullptr) or (xpoints.find(toxpoint) == nullptr)){
+        return {};
+    }
+    SearchState state;
+    BFS(xpoints, fromxpoint, state);
+    if (!reached(state, toxpoint)){
+        return {};
+    }
+    std::vector<std::pair<Coord, Cost>> route;
+    collect_route(route, state, toxpoint);
+    return route;
+}
+
+std::vector<std::pair<Coord, Cost>> find_route_fastest(XpointMap const& xpoints, Coord fromxpoint, Coord toxpoint)
+{
+    return find_route(xpoints, fromxpoint, toxpoint, FASTEST_ROUTE);
+}
+
+std::vector<Coord> find_fibre_cycle(XpointMap const& xpoints, Coord startxpoint)
+{
+    if (xpoints.find(startxpoint) == nullptr){
+        return {};
+    }
+
+    SearchState state;
+    std::pair<Coord, Coord> cycle_pair = { NO_COORD, NO_COORD };
+    if (!DFS(xpoints, startxpoint, state, cycle_pair)){
+        return {};
+    }
+
+    std::vector<Coord> route;
+    route.push_back(cycle_pair.second);
+    Coord xy = cycle_pair.first;
+    while (xy != NO_COORD) {
+        route.push_back(xy);
+        if (xy == route.at(0)) {
+            break;
+        }
+        xy = state.at(xy).pi;
+    }
+    return route;
+}
+
+}
+
+// ---------------------------- Hub trees -------------------------------------
+
+// A hub tree is a SearchState of a finished Dijkstra's search from the hub.
+// When a fibre gets cheaper (or is added), Dijkstra's algorithm continues
+// from its endpoints and visits only the xpoints that get closer. When a
+// fibre of the tree gets dearer (or is removed), the subtree below it is
+// reset, reattached to the rest of the tree through its cheapest fibres, and
+// Dijkstra's algorithm continues from there (Ramalingam & Reps).
+
+namespace {
+
+// Dijkstra's algorithm from the xpoints in the queue, whose distances in tree
+// are already set. Only xpoints whose distance decreases are visited. As no
+// cost is negative, each xpoint is settled at most once, and the loop stops
+// after that many settles even if a negative cost slipped in.
+void propagate(XpointMap const& xpoints, SearchState& tree, MinQueue& min_queue)
+{
+    std::size_t settles_left = xpoints.size();
+    while (!min_queue.empty() and settles_left > 0) {
+        auto [d, u] = min_queue.top();
+        min_queue.pop();
+        // References to unordered_map elements stay valid on insertion
+        auto& u_node = tree[u];
+        if (d > u_node.d) {
+            continue;
+        }
+        const auto& fibres = xpoints.at(u);
+        --settles_left;
+        DS_COUNT(nodes_settled, 1ul);
+        DS_COUNT(edges_relaxed, fibres.size());
+        for (const auto& fibre : fibres) {
+            auto& v_node = tree[fibre.first];
+            if (relax(u, u_node, v_node, fibre.second)) {
+                min_queue.push({v_node.d, fibre.first});
+            }
+        }
+    }
+}
+
+void build_tree(XpointMap const& xpoints, Coord hub, SearchState& tree)
+{
+    tree.clear();
+    auto& hub_node = tree[hub];
+    hub_node.d = 0;
+    if (xpoints.find(hub) != nullptr) {
+        MinQueue min_queue;
+        min_queue.push({0, hub});
+        propagate(xpoints, tree, min_queue);
+    }
+}
+
+// Repairs the tree after the fibre between xpoint1 and xpoint2 was added or
+// got cheaper.
+void tree_fibre_cheaper(XpointMap const& xpoints, SearchState& tree, Coord xpoint1, Coord xpoint2, Cost cost)
+{
+    MinQueue min_queue;
+    for (const auto& [u, v] : {std::make_pair(xpoint1, xpoint2), std::make_pair(xpoint2, xpoint1)}) {
+        auto u_result = tree.find(u);
+        if (u_result == tree.end()) {
+            continue;
+        }
+        auto& u_node = u_result->second;
+        auto& v_node = tree[v];
+        if (relax(u, u_node, v_node, cost)) {
+            min_queue.push({v_node.d, v});
+        }
+    }
+    propagate(xpoints, tree, min_queue);
+}
+
+// Repairs the tree after the fibre between xpoint1 and xpoint2 was removed or
+// got dearer. Nothing changes unless the fibre is part of the tree.
+void tree_fibre_dearer(XpointMap const& xpoints, SearchState& tree, Coord xpoint1, Coord xpoint2)
+{
+    Coord child = NO_COORD;
+    for (const auto& [parent, v] : {std::make_pair(xpoint1, xpoint2), std::make_pair(xpoint2, xpoint1)}) {
+        auto result = tree.find(v);
+        if (result != tree.end() and result->second.pi == parent) {
+            child = v;
+        }
+    }
+    if (child == NO_COORD) {
+        return;
+    }
+
+    // The subtree below the fibre, the only part whose distances can grow
+    std::vector<Coord> affected = {child};
+    for (std::size_t i = 0; i < affected.size(); ++i) {
+        auto fibres = xpoints.find(affected.at(i));
+        if (fibres == nullptr) {
+            continue;
+        }
+        for (const auto& fibre : *fibres) {
+            auto result = tree.find(fibre.first);
+            if (result != tree.end() and result->second.pi == affected.at(i)) {
+                affected.push_back(fibre.first);
+            }
+        }
+    }
+    for (const auto& xy : affected) {
+        tree.at(xy) = SearchNode();
+    }
+
+    // Attach each affected xpoint to its closest unaffected neighbour
+    MinQueue min_queue;
+    for (const auto& xy : affected) {
+        auto fibres = xpoints.find(xy);
+        if (fibres == nullptr) {
+            continue;
+        }
+        auto& node = tree.at(xy);
+        for (const auto& fibre : *fibres) {
+            auto result = tree.find(fibre.first);
+            if (result != tree.end() and result->second.d != INT_MAX) {
+                relax(fibre.first, result->second, node, fibre.second);
+            }
+        }
+        if (node.d != INT_MAX) {
+            min_queue.push({node.d, xy});
+        }
+    }
+    propagate(xpoints, tree, min_queue);
+
+    for (const auto& xy : affected) {
+        if (tree.at(xy).d == INT_MAX) {
+            tree.erase(xy);
+        }
+    }
+}
+
+}
+
+bool Datastructures::update_fibre_cost(Coord xpoint1, Coord xpoint2, Cost cost)
+{
+    DS_TIME_OPERATION();
+    if (batch_.open) {
+        return batch_reject();
+    }
+    auto fibres1 = xpoints_.find(xpoint1);
+    if (cost < 0 or fibres1 == nullptr or fibres1->count(xpoint2) == 0) {
+        return false;
+    }
+    Cost old_cost = fibres1->at(xpoint2);
+    if (cost == old_cost) {
+        return true;
+    }
+    xpoints_.modify(xpoint1).at(xpoint2) = cost;
+    xpoints_.modify(xpoint2).at(xpoint1) = cost;
+    published_xpoints_.reset();
+
+    for (auto& hub : hub_trees_) {
+        if (cost < old_cost) {
+            tree_fibre_cheaper(xpoints_, hub.second, xpoint1, xpoint2, cost);
+        } else {
+            tree_fibre_dearer(xpoints_, hub.second, xpoint1, xpoint2);
+        }
+    }
+    return true;
+}
+
+bool Datastructures::add_hub(Coord xpoint)
+{
+    DS_TIME_OPERATION();
+    if (xpoints_.find(xpoint) == nullptr or hub_trees_.count(xpoint) != 0) {
+        return false;
+    }
+    build_tree(xpoints_, xpoint, hub_trees_[xpoint]);
+    return true;
+}
+
+bool Datastructures::remove_hub(Coord xpoint)
+{
+    DS_TIME_OPERATION();
+    return hub_trees_.erase(xpoint) != 0;
+}
+
+std::vector<Coord> Datastructures::all_hubs()
+{
+    DS_TIME_OPERATION();
+    std::vector<Coord> hubs;
+    hubs.reserve(hub_trees_.size());
+    for (const auto& hub : hub_trees_) {
+        hubs.push_back(hub.first);
+    }
+    std::sort(hubs.begin(), hubs.end());
+    return hubs;
+}
+
+std::vector<std::pair<Coord, Cost>> Datastructures::route_from_hub(Coord hubxpoint, Coord toxpoint)
+{
+    DS_TIME_OPERATION();
+    auto result = hub_trees_.find(hubxpoint);
+    if (result == hub_trees_.end() or !reached(result->second, toxpoint)) {
+        return {};
+    }
+    std::vector<std::pair<Coord, Cost>> route;
+    collect_route(route, result->second, toxpoint);
+    return route;
+}
+
+// ---------------------------- Alternative routes ----------------------------
+
+// Yen's algorithm. Each new route leaves the previous one at some spur
+// xpoint and reaches the target without the xpoints before the spur and
+// without the fibres that the routes found so far take from there. All spur
+// searches share one shortest-path tree grown from the target: its route is
+// used as such whenever it is allowed, otherwise its distances guide an A*
+// search. The spur searches of one round run in parallel.
+
+namespace {
+
+using Route = std::vector<std::pair<Coord, Cost>>;
+
+// A spur search never takes fewer detours than this on a thread of its own
+std::size_t const MIN_DETOURS_PER_TASK = 4;
+
+// What a spur search leaving the previous route at spur_index must avoid:
+// the xpoints before the spur and the banned fibres
+struct Detour
+{
+    std::size_t spur_index = 0;
+    std::set<std::pair<Coord, Coord>> banned_fibres = {};
+};
+
+// Index of each xpoint in the previous route
+using RoutePositions = std::unordered_map<Coord, std::size_t, CoordHash>;
+
+std::pair<Coord, Coord> fibre_key(Coord xpoint1, Coord xpoint2)
+{
+    return xpoint1 < xpoint2 ? std::make_pair(xpoint1, xpoint2) : std::make_pair(xpoint2, xpoint1);
+}
+
+// Fastest route from spur to the root of to_tree that avoids what the
+// detour bans, with costs starting from zero. Empty if there is none.
+Route spur_route(XpointMap const& xpoints, SearchState const& to_tree, Coord spur,
+                RoutePositions const& positions, Detour const& detour)
+{
+    auto allowed = [&positions, &detour](Coord u, Coord v) {
+        auto position = positions.find(v);
+        if (position != positions.end() and position->second < detour.spur_index) {
+            return false;
+        }
+        return detour.banned_fibres.empty() or detour.banned_fibres.count(fibre_key(u, v)) == 0;
+    };
+
+    // Whether the route in the tree from an xpoint avoids the bans, for the
+    // xpoints looked at so far. Routes in the tree merge, so each xpoint is
+    // walked through once.
+    std::unordered_map<Coord, bool, CoordHash> tree_route_allowed;
+    auto allowed_in_tree = [&](Coord xpoint) {
+        std::vector<Coord> walked;
+        bool result = true;
+        for (Coord u = xpoint; ; ) {
+            auto known = tree_route_allowed.find(u);
+            if (known != tree_route_allowed.end()) {
+                result = known->second;
+                break;
+            }
+            walked.push_back(u);
+            Coord v = to_tree.at(u).pi;
+            if (v == NO_COORD) {
+                break;
+            } else if (!allowed(u, v)) {
+                result = false;
+                break;
+            }
+            u = v;
+        }
+        for (const auto& xy : walked) {
+            tree_route_allowed[xy] = result;
+        }
+        return result;
+    };
+
+    // A* with the distances in the tree as the estimate, which is exact
+    // without the bans and so never overestimates. Once the xpoint with the
+    // lowest estimate has an allowed route in the tree, that route is the
+    // fastest one.
+    SearchState state;
+    MinQueue min_queue;
+    state[spur].d = 0;
+    min_queue.push({to_tree.at(spur).d, spur});
+    while (!min_queue.empty()) {
+        auto [f, u] = min_queue.top();
+        min_queue.pop();
+        auto& u_node = state[u];
+        if (u_node.state == BLACK or f > u_node.d + to_tree.at(u).d) {
+            continue;
+        }
+        u_node.state = BLACK;
+        if (allowed_in_tree(u)) {
+            Route route;
+            collect_route(route, state, u);
+            for (Coord v = to_tree.at(u).pi; v != NO_COORD; v = to_tree.at(v).pi) {
+                route.push_back({v, f - to_tree.at(v).d});
+            }
+            return route;
+        }
+        const auto& fibres = xpoints.at(u);
+        DS_COUNT(nodes_settled, 1ul);
+        DS_COUNT(edges_relaxed, fibres.size());
+        for (const auto& fibre : fibres) {
+            auto estimate = to_tree.find(fibre.first);
+            if (estimate == to_tree.end() or !allowed(u, fibre.first)) {
+                continue;
+            }
+            auto& v_node = state[fibre.first];
+            if (v_node.state != BLACK and relax(u, u_node, v_node, fibre.second)) {
+                min_queue.push({v_node.d + estimate->second.d, fibre.first});
+            }
+        }
+    }
+    return {};
+}
+
+// Full routes through the detours first, first + step, ... of the previous route
+std::vector<Route> detour_routes(XpointMap const& xpoints, SearchState const& to_tree, Route const& previous,
+                                 RoutePositions const& positions, std::vector<Detour> const& detours,
+                                 std::size_t first, std::size_t step)
+{
+    std::vector<Route> routes;
+    for (std::size_t i = first; i < detours.size(); i += step) {
+        std::size_t spur_index = detours.at(i).spur_index;
+        auto spur = spur_route(xpoints, to_tree, previous.at(spur_index).first, positions, detours.at(i));
+        if (spur.empty()) {
+            continue;
+        }
+        Route route(previous.begin(), previous.begin() + spur_index);
+        Cost root_cost = previous.at(spur_index).second;
+        for (const auto& xpoint : spur) {
+            route.push_back({xpoint.first, root_cost + xpoint.second});
+        }
+        routes.push_back(std::move(route));
+    }
+    return routes;
+}
+
+// The k fastest loopless routes, cheapest first, leaving out routes that
+// cost more than max_cost. The tree from the target and the estimates taken
+// from it rely on costs never being negative, which add_fibre and
+// update_fibre_cost ensure.
+std::vector<Route> find_k_fastest_routes(XpointMap const& xpoints, Coord fromxpoint, Coord toxpoint,
+                                         std::size_t k, Cost max_cost)
+{
+    std::vector<Route> routes;
+    if (k == 0 or fromxpoint == toxpoint or (xpoints.find(fromxpoint) == nullptr)
+            or (xpoints.find(toxpoint) == nullptr)){
+        return routes;
+    }
+    SearchState to_tree;
+    build_tree(xpoints, toxpoint, to_tree);
+    if (!reached(to_tree, fromxpoint)) {
+        return routes;
+    }
+    auto fastest = spur_route(xpoints, to_tree, fromxpoint, RoutePositions(), Detour());
+    if (fastest.back().second > max_cost) {
+        return routes;
+    }
+    routes.push_back(std::move(fastest));
+
+    // Candidates are ordered by cost, equal routes found twice are kept once
+    std::set<std::pair<Cost, Route>> candidates;
+    auto threads = std::max(1u, std::thread::hardware_concurrency());
+    while (routes.size() < k) {
+        Route const& previous = routes.back();
+        RoutePositions positions;
+        std::vector<Detour> detours(previous.size() - 1);
+        for (std::size_t j = 0; j < detours.size(); ++j) {
+            positions[previous.at(j).first] = j;
+            detours.at(j).spur_index = j;
+        }
+        // A route that shares the first j + 1 xpoints with the previous one
+        // bans the fibre it takes from the j:th
+        for (const auto& route : routes) {
+            for (std::size_t j = 0; j < detours.size() and j + 1 < route.size()
+                    and route.at(j).first == previous.at(j).first; ++j) {
+                detours.at(j).banned_fibres.insert(fibre_key(route.at(j).first, route.at(j + 1).first));
+            }
+        }
+
+        std::size_t tasks = std::min<std::size_t>(threads, detours.size() / MIN_DETOURS_PER_TASK + 1);
+        std::vector<std::future<std::vector<Route>>> others;
+        for (std::size_t task = 1; task < tasks; ++task) {
+            others.push_back(std::async(std::launch::async, detour_routes, std::cref(xpoints), std::cref(to_tree),
+                                        std::cref(previous), std::cref(positions), std::cref(detours),
+                                        task, tasks));
+        }
+        std::vector<std::vector<Route>> found;
+        found.push_back(detour_routes(xpoints, to_tree, previous, positions, detours, 0, tasks));
+        for (auto& other : others) {
+            found.push_back(other.get());
+        }
+        for (auto& task_routes : found) {
+            for (auto& route : task_routes) {
+                Cost cost = route.back().second;
+                if (cost <= max_cost) {
+                    candidates.insert({cost, std::move(route)});
+                }
+            }
+        }
+
+        if (candidates.empty()) {
+            break;
+        }
+        routes.push_back(std::move(candidates.extract(candidates.begin()).value().second));
+    }
+    return routes;
+}
+
+}
+
+std::vector<std::vector<std::pair<Coord, Cost>>> Datastructures::route_k_fastest(Coord fromxpoint, Coord toxpoint, int k)
+{
+    DS_TIME_OPERATION();
+    return find_k_fastest_routes(xpoints_, fromxpoint, toxpoint, static_cast<std::size_t>(std::max(k, 0)),
+                                 std::numeric_limits<Cost>::max());
+}
+
+std::vector<std::vector<std::pair<Coord, Cost>>> Datastructures::routes_within_cost(Coord fromxpoint, Coord toxpoint, Cost max_cost)
+{
+    DS_TIME_OPERATION();
+    return find_k_fastest_routes(xpoints_, fromxpoint, toxpoint, std::numeric_limits<std::size_t>::max(), max_cost);
+}
+
+// ---------------------------- Spatial index ---------------------------------
+
+namespace {
+
+// Fraction of a coordinate unit by which segments are widened when their cells are computed
+double const CELL_MARGIN = 1e-6;
+
+std::int64_t squared_distance(Coord xy1, Coord xy2)
+{
+    std::int64_t dx = static_cast<std::int64_t>(xy1.x) - xy2.x;
+    std::int64_t dy = static_cast<std::int64_t>(xy1.y) - xy2.y;
+    return dx * dx + dy * dy;
+}
+
+// Sign of the turn from a to b to c: positive counterclockwise, 0 if on a line
+int orientation(Coord a, Coord b, Coord c)
+{
+    std::int64_t cross = (static_cast<std::int64_t>(b.x) - a.x) * (static_cast<std::int64_t>(c.y) - a.y)
+            - (static_cast<std::int64_t>(b.y) - a.y) * (static_cast<std::int64_t>(c.x) - a.x);
+    return (cross > 0) - (cross < 0);
+}
+
+// True if c, which is on the line through a and b, is between them
+bool on_segment(Coord a, Coord b, Coord c)
+{
+    return std::min(a.x, b.x) <= c.x and c.x <= std::max(a.x, b.x)
+            and std::min(a.y, b.y) <= c.y and c.y <= std::max(a.y, b.y);
+}
+
+// True if the segments cross or touch
+bool segments_intersect(std::pair<Coord, Coord> const& s1, std::pair<Coord, Coord> const& s2)
+{
+    int o1 = orientation(s1.first, s1.second, s2.first);
+    int o2 = orientation(s1.first, s1.second, s2.second);
+    int o3 = orientation(s2.first, s2.second, s1.first);
+    int o4 = orientation(s2.first, s2.second, s1.second);
+    if (o1 != o2 and o3 != o4) {
+        return true;
+    }
+    return (o1 == 0 and on_segment(s1.first, s1.second, s2.first))
+            or (o2 == 0 and on_segment(s1.first, s1.second, s2.second))
+            or (o3 == 0 and on_segment(s2.first, s2.second, s1.first))
+            or (o4 == 0 and on_segment(s2.first, s2.second, s1.second));
+}
+
+bool in_rectangle(Coord low, Coord high, Coord xy)
+{
+    return low.x <= xy.x and xy.x <= high.x and low.y <= xy.y and xy.y <= high.y;
+}
+
+// True if some part of the segment is in the rectangle
+bool segment_in_rectangle(Coord low, Coord high, std::pair<Coord, Coord> const& segment)
+{
+    if (in_rectangle(low, high, segment.first) or in_rectangle(low, high, segment.second)) {
+        return true;
+    }
+    Coord low_right = {high.x, low.y};
+    Coord high_left = {low.x, high.y};
+    return segments_intersect(segment, {low, low_right}) or segments_intersect(segment, {low_right, high})
+            or segments_intersect(segment, {high, high_left}) or segments_intersect(segment, {high_left, low});
+}
+
+// Corners of the rectangle spanned by two coordinates
+std::pair<Coord, Coord> rectangle(Coord corner1, Coord corner2)
+{
+    return {{std::min(corner1.x, corner2.x), std::min(corner1.y, corner2.y)},
+            {std::max(corner1.x, corner2.x), std::max(corner1.y, corner2.y)}};
+}
+
+// Calls visit for the contents of each occupied cell from low_cell to
+// high_cell, going through either the cell range or all occupied cells,
+// whichever is smaller.
+template <typename Cells, typename Visit>
+void visit_cells(Cells const& cells, Coord low_cell, Coord high_cell, Visit visit)
+{
+    double area = (static_cast<double>(high_cell.x) - low_cell.x + 1) * (static_cast<double>(high_cell.y) - low_cell.y + 1);
+    if (area > static_cast<double>(cells.size())) {
+        for (const auto& cell : cells) {
+            if (in_rectangle(low_cell, high_cell, cell.first)) {
+                visit(cell.second);
+            }
+        }
+        return;
+    }
+    for (int y = low_cell.y; y <= high_cell.y; ++y) {
+        for (int x = low_cell.x; x <= high_cell.x; ++x) {
+            auto cell = cells.find({x, y});
+            if (cell != cells.end()) {
+                visit(cell->second);
+            }
+        }
+    }
+}
+
+template <typename Value>
+void erase_from_cell(std::unordered_map<Coord, std::vector<Value>, CoordHash>& cells, Coord cell, Value const& value)
+{
+    auto result = cells.find(cell);
+    auto& values = result->second;
+    auto position = std::find(values.begin(), values.end(), value);
+    *position = values.back();
+    values.pop_back();
+    if (values.empty()) {
+        cells.erase(result);
+    }
+}
+
+}
+
+Coord SpatialIndex::cell_of(Coord xy)
+{
+    // Rounds towards minus infinity also for negative coordinates
+    auto floor_div = [](int value) {
+        return value >= 0 ? value / CELL_SIZE : -((-(value + 1)) / CELL_SIZE) - 1;
+    };
+    return {floor_div(xy.x), floor_div(xy.y)};
+}
+
+std::vector<Coord> SpatialIndex::cells_of(Segment const& segment)
+{
+    Coord from = segment.first;
+    Coord to = segment.second;
+    if (to.x < from.x) {
+        std::swap(from, to);
+    }
+    Coord from_cell = cell_of(from);
+    Coord to_cell = cell_of(to);
+    std::vector<Coord> cells;
+    for (int x = from_cell.x; x <= to_cell.x; ++x) {
+        // The rows the segment goes through within this column of cells
+        int low_row = std::min(from_cell.y, to_cell.y);
+        int high_row = std::max(from_cell.y, to_cell.y);
+        if (from.x != to.x) {
+            double slope = (static_cast<double>(to.y) - from.y) / (static_cast<double>(to.x) - from.x);
+            double left = std::max<double>(from.x, static_cast<double>(x) * CELL_SIZE);
+            double right = std::min<double>(to.x, (static_cast<double>(x) + 1) * CELL_SIZE);
+            double y1 = from.y + (left - from.x) * slope;
+            double y2 = from.y + (right - from.x) * slope;
+            // The margin keeps rounding from dropping a cell the segment only touches
+            low_row = std::max(low_row, static_cast<int>(std::floor((std::min(y1, y2) - CELL_MARGIN) / CELL_SIZE)));
+            high_row = std::min(high_row, static_cast<int>(std::floor((std::max(y1, y2) + CELL_MARGIN) / CELL_SIZE)));
+        }
+        for (int y = low_row; y <= high_row; ++y) {
+            cells.push_back({x, y});
+        }
+    }
+    return cells;
+}
+
+double SpatialIndex::cell_span(Segment const& segment)
+{
+    Coord cell1 = cell_of(segment.first);
+    Coord cell2 = cell_of(segment.second);
+    return std::abs(static_cast<double>(cell1.x) - cell2.x) + std::abs(static_cast<double>(cell1.y) - cell2.y) + 1;
+}
+
+void SpatialIndex::add_xpoint(Coord xy)
+{
+    xpoints_.insert(xy);
+    xpoint_cells_[cell_of(xy)].push_back(xy);
+}
+
+void SpatialIndex::remove_xpoint(Coord xy)
+{
+    xpoints_.erase(xy);
+    erase_from_cell(xpoint_cells_, cell_of(xy), xy);
+}
+
+void SpatialIndex::add_fibre(Coord xpoint1, Coord xpoint2)
+{
+    Segment segment = xpoint1 < xpoint2 ? Segment{xpoint1, xpoint2} : Segment{xpoint2, xpoint1};
+    if (cell_span(segment) > LONG_FIBRE_CELLS) {
+        long_fibres_.insert(segment);
+        return;
+    }
+    for (const auto& cell : cells_of(segment)) {
+        fibre_cells_[cell].push_back(segment);
+    }
+}
+
+void SpatialIndex::remove_fibre(Coord xpoint1, Coord xpoint2)
+{
+    Segment segment = xpoint1 < xpoint2 ? Segment{xpoint1, xpoint2} : Segment{xpoint2, xpoint1};
+    if (cell_span(segment) > LONG_FIBRE_CELLS) {
+        long_fibres_.erase(segment);
+        return;
+    }
+    for (const auto& cell : cells_of(segment)) {
+        erase_from_cell(fibre_cells_, cell, segment);
+    }
+}
+
+void SpatialIndex::clear()
+{
+    xpoints_.clear();
+    xpoint_cells_.clear();
+    fibre_cells_.clear();
+    long_fibres_.clear();
+}
+
+std::vector<Coord> SpatialIndex::nearest(Coord xy, std::size_t k) const
+{
+    // The k nearest so far, the farthest of them on top
+    std::priority_queue<std::pair<std::int64_t, Coord>> nearest;
+    auto consider = [&nearest, k, xy](std::vector<Coord> const& xpoints) {
+        for (const auto& xpoint : xpoints) {
+            std::pair<std::int64_t, Coord> candidate = {squared_distance(xy, xpoint), xpoint};
+            if (nearest.size() < k) {
+                nearest.push(candidate);
+            } else if (candidate < nearest.top()) {
+                nearest.pop();
+                nearest.push(candidate);
+            }
+        }
+    };
+
+    if (k == 0) {
+        return {};
+    }
+    Coord center = cell_of(xy);
+    for (std::int64_t ring = 0; ; ++ring) {
+        // Xpoints in this ring of cells or farther are at least this far
+        std::int64_t bound = std::max<std::int64_t>(ring - 1, 0) * CELL_SIZE;
+        if (nearest.size() == k and bound * bound > nearest.top().first) {
+            break;
+        }
+        if ((2 * ring + 1) * (2 * ring + 1) > static_cast<std::int64_t>(xpoint_cells_.size())) {
+            // The rings would cover more cells than there are occupied ones
+            nearest = {};
+            for (const auto& cell : xpoint_cells_) {
+                consider(cell.second);
+            }
+            break;
+        }
+        for (std::int64_t dy = -ring; dy <= ring; ++dy) {
+            // Only the first and last rows of the ring are full
+            std::int64_t step = (dy == -ring or dy == ring) ? 1 : 2 * ring;
+            for (std::int64_t dx = -ring; dx <= ring; dx += std::max<std::int64_t>(step, 1)) {
+                auto cell = xpoint_cells_.find({static_cast<int>(center.x + dx), static_cast<int>(center.y + dy)});
+                if (cell != xpoint_cells_.end()) {
+                    consider(cell->second);
+                }
+            }
+        }
+    }
+
+    std::vector<Coord> result(nearest.size());
+    for (auto i = result.size(); i > 0; --i) {
+        result.at(i - 1) = nearest.top().second;
+        nearest.pop();
+    }
+    return result;
+}
+
+std::vector<Coord> SpatialIndex::xpoints_in(Coord corner1, Coord corner2) const
+{
+    auto [low, high] = rectangle(corner1, corner2);
+    std::vector<Coord> result;
+    visit_cells(xpoint_cells_, cell_of(low), cell_of(high), [&](std::vector<Coord> const& xpoints) {
+        for (const auto& xpoint : xpoints) {
+            if (in_rectangle(low, high, xpoint)) {
+                result.push_back(xpoint);
+            }
+        }
+    });
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+std::vector<std::pair<Coord, Coord>> SpatialIndex::fibres_in(Coord corner1, Coord corner2) const
+{
+    auto [low, high] = rectangle(corner1, corner2);
+    // A fibre may be in many cells
+    std::set<Segment> found;
+    auto test = [&](auto const& segments) {
+        for (const auto& segment : segments) {
+            if (segment_in_rectangle(low, high, segment)) {
+                found.insert(segment);
+            }
+        }
+    };
+    visit_cells(fibre_cells_, cell_of(low), cell_of(high), test);
+    test(long_fibres_);
+    return {found.begin(), found.end()};
+}
+
+std::vector<std::pair<Coord, Coord>> SpatialIndex::fibres_crossing(Coord xy1, Coord xy2) const
+{
+    Segment query = {xy1, xy2};
+    std::set<Segment> found;
+    auto test = [&](auto const& segments) {
+        for (const auto& segment : segments) {
+            if (segments_intersect(query, segment)) {
+                found.insert(segment);
+            }
+        }
+    };
+    test(long_fibres_);
+    if (cell_span(query) > static_cast<double>(fibre_cells_.size())) {
+        for (const auto& cell : fibre_cells_) {
+            test(cell.second);
+        }
+    } else {
+        for (const auto& cell : cells_of(query)) {
+            auto result = fibre_cells_.find(cell);
+            if (result != fibre_cells_.end()) {
+                test(result->second);
+            }
+        }
+    }
+    return {found.begin(), found.end()};
+}
+
+void SpatialIndex::memory_usage(MemoryUsage& usage) const
+{
+    std::size_t bytes = xpoints_.size() * set_node_bytes<Coord>() + hash_table_bytes(xpoint_cells_)
+            + hash_table_bytes(fibre_cells_) + long_fibres_.size() * set_node_bytes<Segment>();
+    for (const auto& cell : xpoint_cells_) {
+        bytes += column_bytes(cell.second);
+    }
+    for (const auto& cell : fibre_cells_) {
+        bytes += column_bytes(cell.second);
+    }
+    usage["spatial index"] = bytes;
+}
+
+Coord Datastructures::nearest_xpoint(Coord xy)
+{
+    DS_TIME_OPERATION();
+    auto nearest = spatial_.nearest(xy, 1);
+    return nearest.empty() ? NO_COORD : nearest.front();
+}
+
+std::vector<Coord> Datastructures::nearest_xpoints(Coord xy, int k)
+{
+    DS_TIME_OPERATION();
+    return spatial_.nearest(xy, static_cast<std::size_t>(std::max(k, 0)));
+}
+
+std::vector<Coord> Datastructures::xpoints_in_rectangle(Coord corner1, Coord corner2)
+{
+    DS_TIME_OPERATION();
+    return spatial_.xpoints_in(corner1, corner2);
+}
+
+std::vector<std::pair<Coord, Coord>> Datastructures::fibres_in_rectangle(Coord corner1, Coord corner2)
+{
+    DS_TIME_OPERATION();
+    return spatial_.fibres_in(corner1, corner2);
+}
+
+std::vector<std::pair<Coord, Coord>> Datastructures::fibres_crossing(Coord xy1, Coord xy2)
+{
+    DS_TIME_OPERATION();
+    return spatial_.fibres_crossing(xy1, xy2);
+}
+
+// ---------------------------- Fibres ----------------------------------------
+
+XpointMap::Slot XpointMap::slot_of(Coord xy) const
+{
+    return index_.find(CoordHash()(xy), [&](Slot slot) { return coords_[slot] == xy; });
+}
+
+Fibres const* XpointMap::find(Coord xy) const
+{
+    Slot slot = slot_of(xy);
+    return slot == NO_ROW ? nullptr : fibres_[slot].get();
+}
+
+Fibres const& XpointMap::at(Coord xy) const
+{
+    auto fibres = find(xy);
+    if (fibres == nullptr) {
+        throw std::out_of_range("XpointMap::at");
+    }
+    return *fibres;
+}
+
+Fibres& XpointMap::modify(Coord xy)
+{
+    Slot slot = slot_of(xy);
+    if (slot == NO_ROW) {
+        slot = free_slots_;
+        if (slot != NO_ROW) {
+            free_slots_ = next_free_[slot];
+            next_free_.set(slot, NO_ROW);
+        } else {
+            slot = static_cast<Slot>(coords_.size());
+            coords_.push_back(NO_COORD);
+            fibres_.push_back(nullptr);
+            next_free_.push_back(NO_ROW);
+        }
+        coords_.set(slot, xy);
+        fibres_.set(slot, std::make_shared<Fibres>());
+        index_.insert(slot, [this](Slot other) { return hash_of(other); });
+    }
+    return unshare(fibres_.mutate(slot));
+}
+
+void XpointMap::erase(Coord xy)
+{
+    Slot slot = slot_of(xy);
+    if (slot == NO_ROW) {
+        return;
+    }
+    index_.erase(slot, [this](Slot other) { return hash_of(other); });
+    coords_.set(slot, NO_COORD);
+    fibres_.set(slot, nullptr);
+    next_free_.set(slot, free_slots_);
+    free_slots_ = slot;
+}
+
+void XpointMap::clear()
+{
+    *this = XpointMap();
+}
+
+std::size_t XpointMap::memory_bytes() const
+{
+    std::size_t bytes = index_.memory_bytes() + coords_.memory_bytes() + fibres_.memory_bytes()
+            + next_free_.memory_bytes();
+    for_each([&](Coord, Fibres const& fibres) {
+        bytes += sizeof(Fibres) + hash_table_bytes(fibres);
+    });
+    return bytes;
+}
+
+std::vector<Coord> Datastructures::all_xpoints()
+{
+    DS_TIME_OPERATION();
+    const auto& xpoints = spatial_.xpoints();
+    return {xpoints.begin(), xpoints.end()};
+}
+
+bool Datastructures::add_fibre(Coord xpoint1, Coord xpoint2, Cost cost)
+{
+    DS_TIME_OPERATION();
+    if (batch_.open) {
+        return batch_reject();
+    }
+    if (xpoint1 == xpoint2 or cost < 0) {
+        return false;
+    }
+    auto fibres1 = xpoints_.find(xpoint1);
+    if (fibres1 != nullptr and fibres1->count(xpoint2) != 0){
+        return false;
+    }
+    // Xpoints exist only while they have fibres
+    if (fibres1 == nullptr) {
+        spatial_.add_xpoint(xpoint1);
+    }
+    if (xpoints_.find(xpoint2) == nullptr) {
+        spatial_.add_xpoint(xpoint2);
+    }
+    spatial_.add_fibre(xpoint1, xpoint2);
+    xpoints_.modify(xpoint1)[xpoint2] = cost;
+    xpoints_.modify(xpoint2)[xpoint1] = cost;
+
+    if(xpoint1 < xpoint2){
+        fibres_.insert({xpoint1, xpoint2});
+    } else {
+        fibres_.insert({xpoint2, xpoint1});
+    }
+    published_xpoints_.reset();
+    for (auto& hub : hub_trees_) {
+        tree_fibre_cheaper(xpoints_, hub.second, xpoint1, xpoint2, cost);
+    }
+    return true;
+}
+
+std::vector<std::pair<Coord, Cost> > Datastructures::get_fibres_from(Coord xpoint)
+{
+    DS_TIME_OPERATION();
+    return fibres_from(xpoints_, xpoint);
+}
+
+std::vector<std::pair<Coord, Coord> > Datastructures::all_fibres()
+{
+    DS_TIME_OPERATION();
+    std::vector<std::pair<Coord, Coord>> fibres;
+    for(const auto& fibre : fibres_) {
+        fibres.push_back({fibre.first, fibre.second});
+    }
+    return fibres;
+}
+
+bool Datastructures::remove_fibre(Coord xpoint1, Coord xpoint2)
+{
+    DS_TIME_OPERATION();
+    auto fibres1 = xpoints_.find(xpoint1);
+    if (fibres1 == nullptr or fibres1->count(xpoint2) == 0) {
+        return batch_reject();
+    }
+    std::pair<Coord, Coord> to_be_removed;
+    if (xpoint1 < xpoint2) {
+        to_be_removed = {xpoint1, xpoint2};
+    } else {
+        to_be_removed = {xpoint2, xpoint1};
+    }
+    if (batch_.open) {
+        if (!batch_.removed_fibres.insert(to_be_removed).second) {
+            return batch_reject();
+        }
+        return true;
+    }
+    erase_fibre_ends(xpoint1, xpoint2);
+    fibres_.erase(to_be_removed);
+    published_xpoints_.reset();
+    return true;
+}
+
+void Datastructures::erase_fibre_ends(Coord xpoint1, Coord xpoint2)
+{
+    xpoints_.modify(xpoint1).erase(xpoint2);
+    xpoints_.modify(xpoint2).erase(xpoint1);
+    spatial_.remove_fibre(xpoint1, xpoint2);
+    if (xpoints_.at(xpoint1).empty()){
+        xpoints_.erase(xpoint1);
+        spatial_.remove_xpoint(xpoint1);
+        hub_trees_.erase(xpoint1);
+    }
+    if (xpoints_.at(xpoint2).empty()){
+        xpoints_.erase(xpoint2);
+        spatial_.remove_xpoint(xpoint2);
+        hub_trees_.erase(xpoint2);
+    }
+    for (auto& hub : hub_trees_) {
+        tree_fibre_dearer(xpoints_, hub.second, xpoint1, xpoint2);
+    }
+}
+
+void Datastructures::clear_fibres()
+{
+    DS_TIME_OPERATION();
+    if (batch_.open) {
+        batch_reject();
+        return;
+    }
+    xpoints_.clear();
+    fibres_.clear();
+    spatial_.clear();
+    published_xpoints_.reset();
+    hub_trees_.clear();
+}
+
+std::vector<std::pair<Coord, Cost> > Datastructures::route_any(Coord fromxpoint, Coord toxpoint)
+{
+    DS_TIME_OPERATION();
+    return find_route_any(xpoints_, fromxpoint, toxpoint);
+}
+
+std::vector<std::pair<Coord, Cost>> Datastructures::route_least_xpoints(Coord fromxpoint, Coord toxpoint)
+{
+    DS_TIME_OPERATION();
+    return find_route_least_xpoints(xpoints_, fromxpoint, toxpoint);
+}
+
+std::vector<std::pair<Coord, Cost>> Datastructures::route_fastest(Coord fromxpoint, Coord toxpoint)
+{
+    DS_TIME_OPERATION();
+    return find_route_fastest(xpoints_, fromxpoint, toxpoint);
+}
+
+std::vector<Coord> Datastructures::route_fibre_cycle(Coord startxpoint)
+{
+    DS_TIME_OPERATION();
+    return find_fibre_cycle(xpoints_, startxpoint);
+}
+
+RouteSearch Datastructures::begin_route_search(Coord fromxpoint, Coord toxpoint, SearchKind kind)
+{
+    DS_TIME_OPERATION();
+    return RouteSearch(published_fibres(), fromxpoint, toxpoint, kind);
 }
 
 Cost Datastructures::trim_fibre_network()
 {
-    // Replace this with your implementation
-    return NO_COST;
+    DS_TIME_OPERATION();
+    // Replace this with your implementation
+    return NO_COST;
+}
+
+// ---------------------------- Batched mutations -----------------------------
+
+void Datastructures::begin_batch()
+{
+    DS_TIME_OPERATION();
+    if (batch_.open) {
+        // Batches do not nest. The open batch keeps its changes, and fails.
+        batch_reject();
+        return;
+    }
+    batch_ = {};
+    batch_.open = true;
+}
+
+bool Datastructures::commit()
+{
+    DS_TIME_OPERATION();
+    if (!batch_.open) {
+        return false;
+    }
+    if (batch_.failed) {
+        batch_ = {};
+        return false;
+    }
+    Batch batch = std::move(batch_);
+    batch_ = {};
+    if (!batch_still_valid(batch)) {
+        return false;
+    }
+
+    // Lightbeams first: together they may still close a loop, in which case
+    // the ones already linked are unlinked and nothing is applied
+    for (std::size_t i = 0; i < batch.lightbeams.size(); ++i) {
+        Row source = beacons_.find(batch.lightbeams.at(i).first);
+        Row target = beacons_.find(batch.lightbeams.at(i).second);
+        if (beacons_.is_upstream(target, source)) {
+            while (i-- > 0) {
+                beacons_.unlink(beacons_.find(batch.lightbeams.at(i).first));
+            }
+            return false;
+        }
+        beacons_.link(source, target);
+    }
+
+    // Names and colors, each order is either updated or rebuilt
+    std::vector<std::pair<Row, std::string>> names;
+    names.reserve(batch.names.size());
+    for (const auto& change : batch.names) {
+        names.push_back({beacons_.find(change.first), change.second});
+    }
+    beacons_.set_names(names);
+    std::vector<BeaconStore::ColorChange> colors;
+    colors.reserve(batch.colors.size());
+    for (const auto& change : batch.colors) {
+        colors.push_back({beacons_.find(change.first), change.second, get_brightness(change.second)});
+    }
+    beacons_.set_colors(colors);
+
+    // Fibres
+    for (const auto& fibre : batch.removed_fibres) {
+        erase_fibre_ends(fibre.first, fibre.second);
+    }
+    if (rebuild_is_cheaper(batch.removed_fibres.size(), fibres_.size())) {
+        // Both sets are sorted, so one merging pass finds the removed fibres
+        std::set<std::pair<Coord, Coord>> remaining;
+        std::set_difference(fibres_.begin(), fibres_.end(),
+                            batch.removed_fibres.begin(), batch.removed_fibres.end(),
+                            std::inserter(remaining, remaining.end()));
+        fibres_ = std::move(remaining);
+    } else {
+        for (const auto& fibre : batch.removed_fibres) {
+            fibres_.erase(fibre);
+        }
+    }
+
+    if (!batch.names.empty() or !batch.colors.empty() or !batch.lightbeams.empty()) {
+        published_beacons_.reset();
+    }
+    if (!batch.removed_fibres.empty()) {
+        published_xpoints_.reset();
+    }
+    return true;
+}
+
+void Datastructures::rollback()
+{
+    DS_TIME_OPERATION();
+    batch_ = {};
+}
+
+bool Datastructures::batch_still_valid(Batch const& batch)
+{
+    for (const auto& change : batch.names) {
+        if (beacons_.find(change.first) == NO_ROW) {
+            return false;
+        }
+    }
+    for (const auto& change : batch.colors) {
+        if (beacons_.find(change.first) == NO_ROW) {
+            return false;
+        }
+    }
+    for (const auto& lightbeam : batch.lightbeams) {
+        Row source = beacons_.find(lightbeam.first);
+        if (source == NO_ROW or beacons_.target(source) != NO_ROW
+                or beacons_.find(lightbeam.second) == NO_ROW) {
+            return false;
+        }
+    }
+    for (const auto& fibre : batch.removed_fibres) {
+        auto fibres = xpoints_.find(fibre.first);
+        if (fibres == nullptr or fibres->count(fibre.second) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Datastructures::batch_reject()
+{
+    if (batch_.open) {
+        batch_.failed = true;
+    }
+    return false;
+}
+
+// ---------------------------- Concurrent readers ----------------------------
+
+void Datastructures::publish()
+{
+    DS_TIME_OPERATION();
+    if (!published_beacons_) {
+        published_beacons_ = std::make_shared<const BeaconStore>(beacons_);
+    }
+    std::atomic_store(&snapshot_, std::make_shared<const Snapshot>(published_beacons_, published_fibres()));
+}
+
+std::shared_ptr<const XpointMap> Datastructures::published_fibres()
+{
+    if (!published_xpoints_) {
+        published_xpoints_ = std::make_shared<const XpointMap>(xpoints_);
+    }
+    return published_xpoints_;
+}
+
+std::shared_ptr<const Snapshot> Datastructures::snapshot()
+{
+    return std::atomic_load(&snapshot_);
+}
+
+Snapshot::Snapshot(std::shared_ptr<const BeaconStore> beacons, std::shared_ptr<const XpointMap> xpoints) :
+    beacons_(std::move(beacons)),
+    xpoints_(std::move(xpoints))
+{
+}
+
+int Snapshot::beacon_count() const
+{
+    return static_cast<int>(beacons_->size());
+}
+
+std::vector<BeaconID> Snapshot::all_beacons() const
+{
+    return ids_in_row_order(*beacons_);
+}
+
+std::string Snapshot::get_name(BeaconID id) const
+{
+    return beacon_name(*beacons_, id);
+}
+
+Coord Snapshot::get_coordinates(BeaconID id) const
+{
+    return beacon_coordinates(*beacons_, id);
+}
+
+Color Snapshot::get_color(BeaconID id) const
+{
+    return beacon_color(*beacons_, id);
+}
+
+std::vector<BeaconID> Snapshot::beacons_alphabetically() const
+{
+    return ids_by_name(*beacons_);
+}
+
+std::vector<BeaconID> Snapshot::beacons_brightness_increasing() const
+{
+    return ids_by_brightness(*beacons_);
+}
+
+BeaconID Snapshot::min_brightness() const
+{
+    return id_or_none(*beacons_, beacons_->first_by_brightness());
+}
+
+BeaconID Snapshot::max_brightness() const
+{
+    return id_or_none(*beacons_, beacons_->last_by_brightness());
+}
+
+std::vector<BeaconID> Snapshot::find_beacons(std::string const& name) const
+{
+    return ids_named(*beacons_, name);
+}
+
+std::vector<BeaconID> Snapshot::get_lightsources(BeaconID id) const
+{
+    return lightsources(*beacons_, id);
+}
+
+std::vector<BeaconID> Snapshot::get_all_lightsources(BeaconID id) const
+{
+    return all_lightsources(*beacons_, id);
+}
+
+int Snapshot::count_all_lightsources(BeaconID id) const
+{
+    return all_lightsources_count(*beacons_, id);
+}
+
+bool Snapshot::is_upstream(BeaconID upstreamid, BeaconID downstreamid) const
+{
+    return upstream(*beacons_, upstreamid, downstreamid);
+}
+
+std::vector<BeaconID> Snapshot::path_outbeam(BeaconID id) const
+{
+    return outbeam_path(*beacons_, id);
+}
+
+std::vector<BeaconID> Snapshot::path_inbeam_longest(BeaconID id) const
+{
+    return inbeam_path_longest(*beacons_, id);
+}
+
+Color Snapshot::total_color(BeaconID id) const
+{
+    return beacon_total_color(*beacons_, id);
+}
+
+std::vector<BeaconID> Snapshot::find_beacons_by_color(Color target, int max_distance) const
+{
+    return beacons_by_color(*beacons_, target, max_distance);
+}
+
+std::vector<BeaconID> Snapshot::nearest_color(Color target, int k) const
+{
+    return nearest_colors(*beacons_, target, k);
+}
+
+std::vector<int> Snapshot::brightness_histogram(int buckets) const
+{
+    return histogram_of_brightness(*beacons_, buckets);
+}
+
+std::vector<Coord> Snapshot::all_xpoints() const
+{
+    return xpoint_coords(*xpoints_);
+}
+
+std::vector<std::pair<Coord, Cost>> Snapshot::get_fibres_from(Coord xpoint) const
+{
+    return fibres_from(*xpoints_, xpoint);
+}
+
+std::vector<std::pair<Coord, Coord>> Snapshot::all_fibres() const
+{
+    return fibre_ends(*xpoints_);
+}
+
+std::vector<std::pair<Coord, Cost>> Snapshot::route_any(Coord fromxpoint, Coord toxpoint) const
+{
+    return find_route_any(*xpoints_, fromxpoint, toxpoint);
+}
+
+std::vector<std::pair<Coord, Cost>> Snapshot::route_least_xpoints(Coord fromxpoint, Coord toxpoint) const
+{
+    return find_route_least_xpoints(*xpoints_, fromxpoint, toxpoint);
+}
+
+std::vector<std::pair<Coord, Cost>> Snapshot::route_fastest(Coord fromxpoint, Coord toxpoint) const
+{
+    return find_route_fastest(*xpoints_, fromxpoint, toxpoint);
+}
+
+std::vector<Coord> Snapshot::route_fibre_cycle(Coord startxpoint) const
+{
+    return find_fibre_cycle(*xpoints_, startxpoint);
+}
+
+std::vector<std::vector<std::pair<Coord, Cost>>> Snapshot::route_k_fastest(Coord fromxpoint, Coord toxpoint, int k) const
+{
+    return find_k_fastest_routes(*xpoints_, fromxpoint, toxpoint, static_cast<std::size_t>(std::max(k, 0)),
+                                 std::numeric_limits<Cost>::max());
+}
+
+std::vector<std::vector<std::pair<Coord, Cost>>> Snapshot::routes_within_cost(Coord fromxpoint, Coord toxpoint, Cost max_cost) const
+{
+    return find_k_fastest_routes(*xpoints_, fromxpoint, toxpoint, std::numeric_limits<std::size_t>::max(), max_cost);
+}
+
+RouteSearch Snapshot::begin_route_search(Coord fromxpoint, Coord toxpoint, SearchKind kind) const
+{
+    return RouteSearch(xpoints_, fromxpoint, toxpoint, kind);
+}
+
+Stats Datastructures::stats()
+{
+    return stats_;
+}
+
+void Datastructures::print_stats(std::ostream& output)
+{
+    for (const auto& op : stats_) {
+        const auto& stats = op.second;
+        if (stats.calls == 0) {
+            continue;
+        }
+        // Percentiles are reported as the upper bound of their histogram bucket
+        auto percentile = [&stats](double p) {
+            auto wanted = static_cast<unsigned long>(std::ceil(p * static_cast<double>(stats.calls)));
+            unsigned long seen = 0;
+            for (std::size_t i = 0; i < LATENCY_BUCKETS; ++i) {
+                seen += stats.latency_histogram.at(i);
+                if (seen >= wanted) {
+                    return 2ul << i;
+                }
+            }
+            return 2ul << (LATENCY_BUCKETS - 1);
+        };
+        output << op.first << ": calls " << stats.calls
+               << ", mean " << stats.total_ns / stats.calls << " ns"
+               << ", p50 <" << percentile(0.5) << " ns"
+               << ", p99 <" << percentile(0.99) << " ns";
+        if (stats.nodes_settled != 0 or stats.edges_relaxed != 0) {
+            output << ", nodes settled " << stats.nodes_settled
+                   << ", edges relaxed " << stats.edges_relaxed;
+        }
+        if (stats.max_depth != 0) {
+            output << ", max depth " << stats.max_depth;
+        }
+        if (stats.entries_scanned != 0) {
+            output << ", entries scanned " << stats.entries_scanned;
+        }
+        output << std::endl;
+    }
+}
+
+void Datastructures::reset_stats()
+{
+    stats_.clear();
+}
+
+// ---------------------------- Bulk loading ----------------------------------
+
+namespace {
+
+// Size of one chunk read from the input. Only one chunk and the commands
+// parsed from it are kept in memory at a time.
+std::size_t const INGEST_CHUNK_SIZE = 4 * 1024 * 1024;
+
+enum CommandType { ADD_BEACON, ADD_LIGHTBEAM, ADD_FIBRE, EMPTY_LINE, PARSE_ERROR };
+
+struct IngestCommand
+{
+    CommandType type = EMPTY_LINE;
+    int line = 0;
+    BeaconID id1 = {};
+    BeaconID id2 = {};
+    std::string text = {}; // Beacon name, or the error message for PARSE_ERROR
+    Coord xy1 = NO_COORD;
+    Coord xy2 = NO_COORD;
+    Color color = NO_COLOR;
+    Cost cost = NO_COST;
+};
+
+// Minimal scanner for one line of a command file
+class LineParser
+{
+public:
+    explicit LineParser(std::string_view line) : line_(line) {}
+
+    bool at_end()
+    {
+        skip_space();
+        return pos_ == line_.size();
+    }
+
+    bool word(std::string_view& out)
+    {
+        skip_space();
+        auto start = pos_;
+        while (pos_ < line_.size() and !is_space(line_[pos_])) {
+            ++pos_;
+        }
+        out = line_.substr(start, pos_ - start);
+        return !out.empty();
+    }
+
+    bool quoted(std::string_view& out)
+    {
+        if (!symbol('"')) {
+            return false;
+        }
+        auto end = line_.find('"', pos_);
+        if (end == std::string_view::npos) {
+            return false;
+        }
+        out = line_.substr(pos_, end - pos_);
+        pos_ = end + 1;
+        return true;
+    }
+
+    bool integer(int& out)
+    {
+        skip_space();
+        auto begin = line_.data() + pos_;
+        auto result = std::from_chars(begin, line_.data() + line_.size(), out);
+        if (result.ec != std::errc()) {
+            return false;
+        }
+        pos_ += static_cast<std::size_t>(result.ptr - begin);
+        return true;
+    }
+
+    bool symbol(char c)
+    {
+        skip_space();
+        if (pos_ < line_.size() and line_[pos_] == c) {
+            ++pos_;
+            return true;
+        }
+        return false;
+    }
+
+    bool coord(Coord& xy)
+    {
+        return symbol('(') and integer(xy.x) and symbol(',') and integer(xy.y) and symbol(')');
+    }
+
+    bool color(Color& color)
+    {
+        return symbol('(') and integer(color.r) and symbol(',') and integer(color.g)
+                and symbol(',') and integer(color.b) and symbol(')');
+    }
+
+private:
+    static bool is_space(char c) { return c == ' ' or c == '\t' or c == '\r'; }
+
+    void skip_space()
+    {
+        while (pos_ < line_.size() and is_space(line_[pos_])) {
+            ++pos_;
+        }
+    }
+
+    std::string_view line_;
+    std::size_t pos_ = 0;
+};
+
+std::string long_line_message()
+{
+    return "Line is longer than " + std::to_string(MAX_LINE_LENGTH) + " characters";
+}
+
+IngestCommand parse_command(std::string_view line, int line_number)
+{
+    IngestCommand command;
+    command.line = line_number;
+    if (line.size() > MAX_LINE_LENGTH) {
+        command.type = PARSE_ERROR;
+        command.text = long_line_message();
+        return command;
+    }
+    LineParser parser(line);
+    std::string_view name;
+    if (!parser.word(name) or name.front() == '#') {
+        return command;
+    }
+
+    std::string_view id1;
+    std::string_view id2;
+    std::string_view text;
+    bool ok = false;
+    if (name == "add_beacon") {
+        command.type = ADD_BEACON;
+        ok = parser.word(id1) and parser.quoted(text)
+                and parser.coord(command.xy1) and parser.color(command.color);
+    } else if (name == "add_lightbeam") {
+        command.type = ADD_LIGHTBEAM;
+        ok = parser.word(id1) and parser.word(id2);
+    } else if (name == "add_fibre") {
+        command.type = ADD_FIBRE;
+        ok = parser.coord(command.xy1) and parser.coord(command.xy2) and parser.integer(command.cost);
+    } else {
+        command.type = PARSE_ERROR;
+        command.text = "Unknown command: " + std::string(name);
+        return command;
+    }
+
+    if (!ok or !parser.at_end()) {
+        command.type = PARSE_ERROR;
+        command.text = "Malformed " + std::string(name) + " command";
+        return command;
+    }
+    command.id1 = id1;
+    command.id2 = id2;
+    command.text = text;
+    return command;
+}
+
+std::vector<IngestCommand> parse_commands(std::string_view text, int first_line)
+{
+    std::vector<IngestCommand> commands;
+    int line_number = first_line;
+    while (!text.empty()) {
+        auto end = text.find('\n');
+        auto line = text.substr(0, end);
+        auto command = parse_command(line, line_number);
+        if (command.type != EMPTY_LINE) {
+            commands.push_back(std::move(command));
+        }
+        ++line_number;
+        if (end == std::string_view::npos) {
+            break;
+        }
+        text.remove_prefix(end + 1);
+    }
+    return commands;
+}
+
+// Splits text into at most n parts, cutting only after a newline
+std::vector<std::string_view> split_lines(std::string_view text, std::size_t n)
+{
+    std::vector<std::string_view> parts;
+    std::size_t part_size = text.size() / n + 1;
+    while (!text.empty()) {
+        auto end = text.find('\n', std::min(part_size, text.size()) - 1);
+        end = (end == std::string_view::npos) ? text.size() : end + 1;
+        parts.push_back(text.substr(0, end));
+        text.remove_prefix(end);
+    }
+    return parts;
+}
+
+std::string coord_to_string(Coord xy)
+{
+    return "(" + std::to_string(xy.x) + "," + std::to_string(xy.y) + ")";
+}
+
+}
+
+std::vector<IngestError> Datastructures::ingest_stream(std::istream& input)
+{
+    DS_TIME_OPERATION();
+    if (batch_.open) {
+        batch_reject();
+        return {{0, "Cannot ingest while a batch is open"}};
+    }
+    std::vector<IngestError> errors;
+    auto threads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<char> buffer(INGEST_CHUNK_SIZE);
+    std::string chunk;
+    std::string carry;
+    int line_number = 1;
+
+    // Consecutive beacons are added together, so that a file of beacons
+    // builds the name and brightness orders once instead of row by row
+    std::vector<BeaconStore::NewBeacon> new_beacons;
+    std::vector<int> new_beacon_lines;
+    std::size_t first_beacon_error = 0;
+    auto add_new_beacons = [&]() {
+        if (new_beacons.empty()) {
+            return;
+        }
+        auto rows = beacons_.add_all(new_beacons);
+        for (std::size_t i = 0; i < rows.size(); ++i) {
+            if (rows[i] == NO_ROW) {
+                errors.push_back({new_beacon_lines[i], "Beacon ID already exists: " + new_beacons[i].id});
+            }
+        }
+        new_beacons.clear();
+        new_beacon_lines.clear();
+        // Color errors were reported while the beacons were collected
+        std::stable_sort(errors.begin() + static_cast<std::ptrdiff_t>(first_beacon_error), errors.end(),
+                         [](IngestError const& lhs, IngestError const& rhs) { return lhs.line < rhs.line; });
+        published_beacons_.reset();
+    };
+
+    auto apply = [&](std::vector<IngestCommand>& commands) {
+        auto beacon_commands = std::count_if(commands.begin(), commands.end(),
+                                             [](auto& command){ return command.type == ADD_BEACON; });
+        beacons_.reserve(beacons_.size() + static_cast<std::size_t>(beacon_commands));
+
+        for (auto& command : commands) {
+            if (command.type != ADD_BEACON) {
+                add_new_beacons();
+            } else if (new_beacons.empty()) {
+                first_beacon_error = errors.size();
+            }
+            switch (command.type) {
+            case ADD_BEACON:
+                if (!is_packable(command.color)) {
+                    errors.push_back({command.line, "Color channels must be 0..255: " + command.id1});
+                } else {
+                    new_beacons.push_back({std::move(command.id1), std::move(command.text), command.xy1,
+                                           command.color, get_brightness(command.color)});
+                    new_beacon_lines.push_back(command.line);
+                }
+                break;
+            case ADD_LIGHTBEAM: {
+                Row source = beacons_.find(command.id1);
+                Row target = beacons_.find(command.id2);
+                if (source == NO_ROW) {
+                    errors.push_back({command.line, "Unknown beacon ID: " + command.id1});
+                } else if (target == NO_ROW) {
+                    errors.push_back({command.line, "Unknown beacon ID: " + command.id2});
+                } else if (beacons_.target(source) != NO_ROW) {
+                    errors.push_back({command.line, "Beacon already has a lightbeam: " + command.id1});
+                } else if (source == target) {
+                    errors.push_back({command.line, "Lightbeam from beacon to itself: " + command.id1});
+                } else if (beacons_.is_upstream(target, source)) {
+                    errors.push_back({command.line, "Lightbeam would close a loop: " + command.id1
+                                      + " " + command.id2});
+                } else {
+                    beacons_.link(source, target);
+                    published_beacons_.reset();
+                }
+                break;
+            }
+            case ADD_FIBRE:
+                if (command.xy1 == command.xy2) {
+                    errors.push_back({command.line, "Fibre from xpoint to itself: " + coord_to_string(command.xy1)});
+                } else if (command.cost < 0) {
+                    errors.push_back({command.line, "Fibre cost must not be negative: " + std::to_string(command.cost)});
+                } else if (!add_fibre(command.xy1, command.xy2, command.cost)) {
+                    errors.push_back({command.line, "Fibre already exists: " + coord_to_string(command.xy1)
+                                      + " " + coord_to_string(command.xy2)});
+                }
+                break;
+            case PARSE_ERROR:
+                errors.push_back({command.line, std::move(command.text)});
+                break;
+            case EMPTY_LINE:
+                break;
+            }
+        }
+    };
+
+    // A line that is still incomplete after MAX_LINE_LENGTH characters is
+    // skipped up to its newline, so that carry stays bounded
+    bool skipping_line = false;
+    int long_line = 0;
+    while (input) {
+        input.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+        chunk = std::move(carry);
+        carry.clear();
+        chunk.append(buffer.data(), static_cast<std::size_t>(input.gcount()));
+        if (skipping_line) {
+            auto newline = chunk.find('\n');
+            if (newline == std::string::npos) {
+                continue;
+            }
+            chunk.erase(0, newline + 1);
+            ++line_number;
+            skipping_line = false;
+        }
+        if (input) {
+            // More data follows, leave the incomplete last line for the next round
+            auto last_newline = chunk.rfind('\n');
+            auto carry_start = (last_newline == std::string::npos) ? 0 : last_newline + 1;
+            carry.assign(chunk, carry_start, std::string::npos);
+            chunk.resize(carry_start);
+            if (carry.size() > MAX_LINE_LENGTH) {
+                long_line = line_number + static_cast<int>(std::count(chunk.begin(), chunk.end(), '\n'));
+                carry.clear();
+                skipping_line = true;
+            }
+        }
+
+        auto parts = split_lines(chunk, threads);
+        std::vector<std::future<std::vector<IngestCommand>>> parsed;
+        parsed.reserve(parts.size());
+        for (const auto& part : parts) {
+            parsed.push_back(std::async(std::launch::async, parse_commands, part, line_number));
+            line_number += static_cast<int>(std::count(part.begin(), part.end(), '\n'));
+        }
+        // Commands are applied in file order so that lightbeams may refer
+        // to beacons added earlier in the same chunk
+        for (auto& part : parsed) {
+            auto commands = part.get();
+            apply(commands);
+        }
+        if (long_line != 0) {
+            add_new_beacons();
+            errors.push_back({long_line, long_line_message()});
+            long_line = 0;
+        }
+    }
+    add_new_beacons();
+    return errors;
+}
+
+std::vector<IngestError> Datastructures::ingest_file(std::string const& filename)
+{
+    DS_TIME_OPERATION();
+    std::ifstream file(filename, std::ios::binary);
+    if (!file) {
+        return {{0, "Cannot open file: " + filename}};
+    }
+    return ingest_stream(file);
 }
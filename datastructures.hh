@@ -13,9 +13,33 @@
 #include <deque>
 #include <climits>
 #include <set>
+#include <unordered_set>
+#include <cstdint>
+#include <string_view>
+#include <istream>
+#include <random>
+#include <array>
+#include <ostream>
+#include <chrono>
+#include <stack>
+#include <queue>
+#include <atomic>
 
 //------------------------- PROVIDED BY THE COURSE ----------------------------
 
+extern std::minstd_rand rand_engine; // Reasonably quick pseudo-random generator
+
+template <typename Type>
+Type random_in_range(Type start, Type end)
+{
+    auto range = end-start;
+    ++range;
+
+    auto num = std::uniform_int_distribution<unsigned long int>(0, range-1)(rand_engine);
+
+    return static_cast<Type>(start+num);
+}
+
 // Type for beacon IDs
 using BeaconID = std::string;
 
@@ -44,11 +68,15 @@ struct CoordHash
 {
     std::size_t operator()(Coord xy) const
     {
-        auto hasher = std::hash<int>();
-        auto xhash = hasher(xy.x);
-        auto yhash = hasher(xy.y);
-        // Combine hash values (magic!)
-        return xhash ^ (yhash + 0x9e3779b9 + (xhash << 6) + (xhash >> 2));
+        // Both coordinates side by side, so that with a 64-bit size_t no two
+        // coordinates share a hash value. Every coordinate map (the xpoints,
+        // the route search states, hub trees and spatial grid cells) hashes
+        // with this. Mixing the two as in hash_combine gave the xpoints of a
+        // 1000 x 1000 grid only some 65000 distinct values, so every lookup
+        // probed through long runs of colliding keys.
+        auto x = static_cast<std::uint64_t>(static_cast<std::uint32_t>(xy.x));
+        auto y = static_cast<std::uint64_t>(static_cast<std::uint32_t>(xy.y));
+        return std::hash<std::uint64_t>()((x << 32) | y);
     }
 };
 
@@ -90,36 +118,886 @@ Cost const NO_COST = NO_VALUE;
 
 enum State { WHITE, GRAY, BLACK };
 
-struct Beacon
+// Memory used by each structure in bytes, keyed by structure name. Node and
+// bucket overheads are estimated from the container sizes.
+using MemoryUsage = std::map<std::string, std::size_t>;
+
+// Index of a beacon in BeaconStore
+using Row = std::uint32_t;
+
+// Return value for cases where a beacon row was not found
+Row const NO_ROW = std::numeric_limits<Row>::max();
+
+// Colors are stored packed as 0x00RRGGBB, so each channel must be 0..255
+inline bool is_packable(Color c)
 {
-    BeaconID id = NO_ID;
-    std::string name = NO_NAME;
-    Coord coords = NO_COORD;
-    Color color = NO_COLOR;
-    int brightness = NO_VALUE;
-    BeaconID target = NO_ID;
-    std::vector<BeaconID> sources = {};
+    return c.r >= 0 and c.r <= 255 and c.g >= 0 and c.g <= 255 and c.b >= 0 and c.b <= 255;
+}
+
+inline std::uint32_t pack_color(Color c)
+{
+    return static_cast<std::uint32_t>(c.r) << 16 | static_cast<std::uint32_t>(c.g) << 8 | static_cast<std::uint32_t>(c.b);
+}
+
+inline Color unpack_color(std::uint32_t packed)
+{
+    return {static_cast<int>(packed >> 16 & 0xff), static_cast<int>(packed >> 8 & 0xff), static_cast<int>(packed & 0xff)};
+}
+
+// Brightness of the brightest color, 3 * 255 + 6 * 255 + 255
+int const MAX_BRIGHTNESS = 2550;
+
+// Packed color of a free row. Never equal to a real packed color.
+std::uint32_t const FREE_ROW_COLOR = 0xff000000;
+
+// Makes ptr the only owner of its object, copying the object first if it is
+// shared, and returns the object for modification. New owners are only made
+// by the thread calling this, so an object found unshared stays unshared.
+template <typename T>
+T& unshare(std::shared_ptr<T>& ptr)
+{
+    if (ptr.use_count() > 1) {
+        ptr = std::make_shared<T>(*ptr);
+    } else {
+        // The former other owners may have read the object until they let it go
+        std::atomic_thread_fence(std::memory_order_acquire);
+    }
+    return *ptr;
+}
+
+// Column of values split into pages, which copies of the column share.
+// Copying a column costs O(1); a page, the directory block above it and the
+// list of blocks are copied when they are first modified while shared.
+// Snapshots are made of such copies, so the writer pays only for the pages
+// it touches afterwards.
+template <typename T>
+class PagedColumn
+{
+public:
+    // Values in a page, and pages in a directory block
+    static std::size_t const PAGE_SIZE = 256;
+    static std::size_t const BLOCK_SIZE = 64;
+
+    std::size_t size() const { return size_; }
+
+    T const& operator[](std::size_t i) const
+    {
+        return (*(*(*blocks_)[i / (PAGE_SIZE * BLOCK_SIZE)])[i / PAGE_SIZE % BLOCK_SIZE])[i % PAGE_SIZE];
+    }
+
+    // The value at i for modification, valid until the column is next copied
+    T& mutate(std::size_t i)
+    {
+        auto& block = unshare(unshare(blocks_)[i / (PAGE_SIZE * BLOCK_SIZE)]);
+        return unshare(block[i / PAGE_SIZE % BLOCK_SIZE])[i % PAGE_SIZE];
+    }
+
+    void set(std::size_t i, T const& value) { mutate(i) = value; }
+
+    void push_back(T const& value)
+    {
+        if (!blocks_) {
+            blocks_ = std::make_shared<Blocks>();
+        }
+        auto& blocks = unshare(blocks_);
+        if (size_ % (PAGE_SIZE * BLOCK_SIZE) == 0) {
+            blocks.push_back(std::make_shared<Block>());
+        }
+        if (size_ % PAGE_SIZE == 0) {
+            unshare(blocks.back())[size_ / PAGE_SIZE % BLOCK_SIZE] = std::make_shared<Page>();
+        }
+        ++size_;
+        mutate(size_ - 1) = value;
+    }
+
+    void clear()
+    {
+        blocks_.reset();
+        size_ = 0;
+    }
+
+    // Calls f(first, values, count) for the values of each page in order
+    template <typename F>
+    void for_each_page(F f) const
+    {
+        for (std::size_t first = 0; first < size_; first += PAGE_SIZE) {
+            f(first, &(*this)[first], size_ - first < PAGE_SIZE ? size_ - first : PAGE_SIZE);
+        }
+    }
+
+    // Shared pages are counted as if they were not
+    std::size_t memory_bytes() const
+    {
+        std::size_t pages = (size_ + PAGE_SIZE - 1) / PAGE_SIZE;
+        return pages * (sizeof(Page) + sizeof(std::shared_ptr<Page>) + CONTROL_BLOCK_BYTES)
+                + (blocks_ ? blocks_->size() * (sizeof(Block) + CONTROL_BLOCK_BYTES) : 0);
+    }
+
+private:
+    // Estimated bytes of the reference counts allocated with each page and block
+    static std::size_t const CONTROL_BLOCK_BYTES = 16;
+
+    using Page = std::array<T, PAGE_SIZE>;
+    using Block = std::array<std::shared_ptr<Page>, BLOCK_SIZE>;
+    using Blocks = std::vector<std::shared_ptr<Block>>;
+
+    std::shared_ptr<Blocks> blocks_;
+    std::size_t size_ = 0;
 };
 
-struct Xpoint
+// Open addressing hash index of rows, with linear probing, kept in a
+// PagedColumn so that copies share it. The keys are not stored: callers give
+// the hash of a key and tell which rows have it, and hash_of(row) gives the
+// hash of the key of an indexed row, for moving rows around.
+class HashIndex
+{
+public:
+    std::size_t size() const { return size_; }
+
+    // The row for which matches(row) holds, NO_ROW if none
+    template <typename Matches>
+    Row find(std::size_t hash, Matches matches) const
+    {
+        if (size_ == 0) {
+            return NO_ROW;
+        }
+        std::size_t mask = slots_.size() - 1;
+        for (std::size_t slot = mix(hash) & mask; slots_[slot] != NO_ROW; slot = (slot + 1) & mask) {
+            if (matches(slots_[slot])) {
+                return slots_[slot];
+            }
+        }
+        return NO_ROW;
+    }
+
+    // The row must not be in the index yet
+    template <typename HashOf>
+    void insert(Row row, HashOf hash_of)
+    {
+        reserve(size_ + 1, hash_of);
+        place(row, hash_of(row));
+        ++size_;
+    }
+
+    // The row must be in the index
+    template <typename HashOf>
+    void erase(Row row, HashOf hash_of)
+    {
+        std::size_t mask = slots_.size() - 1;
+        std::size_t hole = mix(hash_of(row)) & mask;
+        while (slots_[hole] != row) {
+            hole = (hole + 1) & mask;
+        }
+        // Move later rows of the cluster back, unless that would put them
+        // before their home slot
+        for (std::size_t slot = (hole + 1) & mask; slots_[slot] != NO_ROW; slot = (slot + 1) & mask) {
+            std::size_t home = mix(hash_of(slots_[slot])) & mask;
+            if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+                slots_.set(hole, slots_[slot]);
+                hole = slot;
+            }
+        }
+        slots_.set(hole, NO_ROW);
+        --size_;
+    }
+
+    // Makes room for n rows without growing
+    template <typename HashOf>
+    void reserve(std::size_t n, HashOf hash_of)
+    {
+        if (2 * n <= slots_.size()) {
+            return;
+        }
+        std::size_t slot_count = MIN_SLOTS;
+        while (slot_count < 2 * n) {
+            slot_count *= 2;
+        }
+        PagedColumn<Row> old_slots = std::move(slots_);
+        slots_.clear();
+        for (std::size_t slot = 0; slot < slot_count; ++slot) {
+            slots_.push_back(NO_ROW);
+        }
+        old_slots.for_each_page([&](std::size_t, Row const* rows, std::size_t count) {
+            for (std::size_t i = 0; i < count; ++i) {
+                if (rows[i] != NO_ROW) {
+                    place(rows[i], hash_of(rows[i]));
+                }
+            }
+        });
+    }
+
+    void clear()
+    {
+        slots_.clear();
+        size_ = 0;
+    }
+
+    std::size_t memory_bytes() const { return slots_.memory_bytes(); }
+
+private:
+    static std::size_t const MIN_SLOTS = 16;
+
+    // Spreads the bits of a hash, as std::hash of an int is the int itself
+    static std::size_t mix(std::size_t hash)
+    {
+        std::uint64_t h = hash;
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return static_cast<std::size_t>(h);
+    }
+
+    void place(Row row, std::size_t hash)
+    {
+        std::size_t mask = slots_.size() - 1;
+        std::size_t slot = mix(hash) & mask;
+        while (slots_[slot] != NO_ROW) {
+            slot = (slot + 1) & mask;
+        }
+        slots_.set(slot, row);
+    }
+
+    PagedColumn<Row> slots_;
+    std::size_t size_ = 0;
+};
+
+// Treaps over nodes numbered 0, 1, ..., with the links and subtree sizes in
+// a paged column, so copies share them. Each treap holds a sequence of nodes;
+// split and merge work on positions, and users that need a sorted sequence
+// insert each node at its place. Priorities are a hash of the node number.
+class TreapForest
+{
+public:
+    using Node = std::uint32_t;
+    static constexpr Node NO_NODE = NO_ROW;
+
+    // Adds node number node_count() as a sequence of its own
+    void push_back();
+    // Makes node a sequence of its own again
+    void reset(Node node);
+    void clear();
+    std::size_t node_count() const { return links_.size(); }
+
+    // Number of nodes in the sequence of root
+    std::size_t size(Node root) const { return root == NO_NODE ? 0 : links_[root].size; }
+    Node root(Node node) const;
+    // Number of nodes before node in its sequence
+    std::size_t position(Node node) const;
+    Node first(Node root) const;
+    Node last(Node root) const;
+    // The node after node in its sequence, NO_NODE after the last one
+    Node next(Node node) const;
+    // Splits a sequence into its first count nodes and the rest
+    std::pair<Node, Node> split(Node root, std::size_t count);
+    Node merge(Node left, Node right);
+    // Sequence of the nodes in the given order, built in linear time. The
+    // nodes must be sequences of their own.
+    Node build(std::vector<Node> const& nodes);
+
+    // Inserts node, a sequence of its own, into a sequence right after the
+    // nodes for which less(other) holds, which must come first. Returns the
+    // new root. Only the subtree that node takes the place of is split.
+    template <typename Less>
+    Node insert(Node root, Node node, Less less)
+    {
+        Node parent = NO_NODE;
+        bool to_left = false;
+        Node place = root;
+        while (place != NO_NODE and priority(place) >= priority(node)) {
+            links_.mutate(place).size += 1;
+            parent = place;
+            to_left = !less(place);
+            place = to_left ? links_[place].left : links_[place].right;
+        }
+        auto [before, after] = split(place, count_less(place, less));
+        attach(node, before, after);
+        links_.mutate(node).parent = parent;
+        if (parent == NO_NODE) {
+            return node;
+        }
+        if (to_left) {
+            links_.mutate(parent).left = node;
+        } else {
+            links_.mutate(parent).right = node;
+        }
+        return root;
+    }
+
+    // Takes node out of the sequence of root, leaving it a sequence of its
+    // own. Returns the new root.
+    Node erase(Node root, Node node);
+
+    // Number of nodes of a sequence for which less(node) holds, when those
+    // nodes come first
+    template <typename Less>
+    std::size_t count_less(Node root, Less less) const
+    {
+        std::size_t count = 0;
+        while (root != NO_NODE) {
+            if (less(root)) {
+                count += size(links_[root].left) + 1;
+                root = links_[root].right;
+            } else {
+                root = links_[root].left;
+            }
+        }
+        return count;
+    }
+
+    // First node of a sequence for which less(node) does not hold, when the
+    // nodes for which it holds come first. NO_NODE if there is none.
+    template <typename Less>
+    Node lower_bound(Node root, Less less) const
+    {
+        Node result = NO_NODE;
+        while (root != NO_NODE) {
+            if (less(root)) {
+                root = links_[root].right;
+            } else {
+                result = root;
+                root = links_[root].left;
+            }
+        }
+        return result;
+    }
+
+    std::size_t memory_bytes() const;
+
+private:
+    static std::uint32_t priority(Node node);
+    void update(Node node);
+    // Makes left and right, roots of their own, the children of node
+    void attach(Node node, Node left, Node right);
+    // Sets the subtree sizes below root after build
+    std::uint32_t update_sizes(Node root);
+
+    // The links of a node, together so that visiting it touches one page
+    struct Links
+    {
+        Node parent = NO_NODE;
+        Node left = NO_NODE;
+        Node right = NO_NODE;
+        std::uint32_t size = 1;
+    };
+
+    PagedColumn<Links> links_;
+};
+
+// Column-oriented storage of beacons. Each beacon has a row, and every
+// attribute is a column indexed by row. Rows of removed beacons are reused;
+// free rows are chained through the next_source column. Lightsources are
+// kept as an intrusive list through the next_source column, so a beacon with
+// any number of sources needs no allocations of its own. All columns are
+// paged, so copying the store for a snapshot costs O(1).
+//
+// The rows are also kept in name order and in brightness order, each in a
+// treap of its own, ties broken by row.
+//
+// The lightbeams form a forest, which is indexed by its Euler tour: each
+// beacon has an enter and an exit token, and the tokens of all beacons
+// whose light reaches a beacon lie between its own two. The tour is kept in
+// a treap whose nodes are the tokens.
+class BeaconStore
+{
+public:
+    std::size_t size() const { return id_index_.size(); }
+    // Rows are 0..end()-1, some of which may be free
+    Row end() const { return static_cast<Row>(ids_.size()); }
+    bool alive(Row row) const { return colors_[row] != FREE_ROW_COLOR; }
+
+    Row find(BeaconID const& id) const
+    {
+        return id_index_.find(std::hash<BeaconID>()(id), [&](Row row) { return ids_[row] == id; });
+    }
+
+    // Returns the row of the new beacon, or NO_ROW if the id is already taken
+    Row add(BeaconID const& id, std::string_view name, Coord xy, Color color, int brightness);
+    struct NewBeacon
+    {
+        BeaconID id;
+        std::string name;
+        Coord xy;
+        Color color;
+        int brightness;
+    };
+    // Adds many beacons at once, building the orders from scratch instead of
+    // inserting each row when that is cheaper. Returns the row of each beacon,
+    // NO_ROW where the id was already taken.
+    std::vector<Row> add_all(std::vector<NewBeacon> const& beacons);
+    // The row must have no target and no sources left
+    void remove(Row row);
+    void clear();
+    void reserve(std::size_t n);
+
+    BeaconID const& id(Row row) const { return ids_[row]; }
+    // The view is valid until the next modification of the store
+    std::string_view name(Row row) const { return names_[row]; }
+    void set_name(Row row, std::string_view name);
+    Coord coords(Row row) const { return coords_[row]; }
+    Color color(Row row) const { return unpack_color(colors_[row]); }
+    int brightness(Row row) const { return brightness_[row]; }
+    void set_color(Row row, Color color, int brightness);
+    // All packed colors, FREE_ROW_COLOR for free rows
+    PagedColumn<std::uint32_t> const& packed_colors() const { return colors_; }
+    // All brightnesses, NO_VALUE for free rows
+    PagedColumn<int> const& brightnesses() const { return brightness_; }
+
+    // Changes many names or colors at once, rebuilding the order instead
+    // of moving each row in it when that is cheaper
+    void set_names(std::vector<std::pair<Row, std::string>> const& changes);
+    struct ColorChange
+    {
+        Row row;
+        Color color;
+        int brightness;
+    };
+    void set_colors(std::vector<ColorChange> const& changes);
+
+    // Rows in name order
+    Row first_by_name() const { return name_order_.first(name_root_); }
+    Row next_by_name(Row row) const { return name_order_.next(row); }
+    // First row in name order whose name is not less than name, NO_ROW if none
+    Row lower_bound_name(std::string_view name) const;
+    // Rows in brightness order
+    Row first_by_brightness() const { return dimmest_; }
+    Row last_by_brightness() const { return brightest_; }
+    Row next_by_brightness(Row row) const { return brightness_order_.next(row); }
+
+    Row target(Row row) const { return target_[row]; }
+    // Sources of a beacon are listed in id order
+    Row first_source(Row row) const { return first_source_[row]; }
+    Row next_source(Row row) const { return next_source_[row]; }
+    // The source must have no target, and target must not be upstream of it
+    void link(Row source, Row target);
+    // Removes the lightbeam from source to its target. Returns the number of
+    // list entries walked.
+    std::size_t unlink(Row source);
+
+    // True if the light of upstream reaches downstream through lightbeams
+    bool is_upstream(Row upstream, Row downstream) const;
+    // Number of beacons whose light reaches row
+    std::size_t upstream_count(Row row) const;
+    // Appends the rows of the beacons whose light reaches row, in tour order
+    void upstream_rows(Row row, std::vector<Row>& rows) const;
+
+    void memory_usage(MemoryUsage& usage) const;
+
+private:
+    using Token = TreapForest::Node;
+    static Token enter_token(Row row) { return 2 * row; }
+    static Token exit_token(Row row) { return 2 * row + 1; }
+
+    std::size_t hash_of(Row row) const { return std::hash<BeaconID>()(ids_[row]); }
+    // As add, but leaves the row out of the name and brightness orders
+    Row add_unordered(BeaconID const& id, std::string_view name, Coord xy, Color color, int brightness);
+    bool name_less(Row lhs, Row rhs) const;
+    bool brightness_less(Row lhs, Row rhs) const;
+    // Rebuilds an order from scratch
+    void build_name_order();
+    void build_brightness_order();
+    void update_brightness_ends();
+
+    HashIndex id_index_;
+    // Empty for free rows, as are names
+    PagedColumn<BeaconID> ids_;
+    PagedColumn<std::string> names_;
+    PagedColumn<Coord> coords_;
+    PagedColumn<std::uint32_t> colors_;
+    PagedColumn<int> brightness_;
+    PagedColumn<Row> target_;
+    PagedColumn<Row> first_source_;
+    PagedColumn<Row> next_source_;
+    Row free_rows_ = NO_ROW;
+    TreapForest tour_;
+    TreapForest name_order_;
+    Row name_root_ = NO_ROW;
+    TreapForest brightness_order_;
+    Row brightness_root_ = NO_ROW;
+    Row dimmest_ = NO_ROW;
+    Row brightest_ = NO_ROW;
+};
+
+// Fibres of one xpoint, by the xpoint at their other end
+using Fibres = std::unordered_map<Coord, Cost, CoordHash>;
+
+// The xpoints and their fibres. Xpoints have slots found through a
+// HashIndex, and the fibres of each xpoint are shared between copies of the
+// map, so copying the map for a snapshot costs O(1) and a change copies only
+// the fibre lists and pages it touches.
+class XpointMap
+{
+public:
+    std::size_t size() const { return index_.size(); }
+    // Fibres of an xpoint, nullptr if there is no such xpoint
+    Fibres const* find(Coord xy) const;
+    // Fibres of an xpoint, throws std::out_of_range if there is no such xpoint
+    Fibres const& at(Coord xy) const;
+    // Fibres of an xpoint for modification, adding the xpoint if it is new
+    Fibres& modify(Coord xy);
+    void erase(Coord xy);
+    void clear();
+
+    // Calls f(xy, fibres) for each xpoint, in no particular order
+    template <typename F>
+    void for_each(F f) const
+    {
+        coords_.for_each_page([&](std::size_t first, Coord const* coords, std::size_t count) {
+            for (std::size_t i = 0; i < count; ++i) {
+                if (coords[i] != NO_COORD) {
+                    f(coords[i], *fibres_[first + i]);
+                }
+            }
+        });
+    }
+
+    std::size_t memory_bytes() const;
+
+private:
+    using Slot = Row;
+
+    Slot slot_of(Coord xy) const;
+    std::size_t hash_of(Slot slot) const { return CoordHash()(coords_[slot]); }
+
+    HashIndex index_;
+    // NO_COORD for free slots
+    PagedColumn<Coord> coords_;
+    PagedColumn<std::shared_ptr<Fibres>> fibres_;
+    // Free slots are chained through this column
+    PagedColumn<Slot> next_free_;
+    Slot free_slots_ = NO_ROW;
+};
+
+// Uniform grid over the xpoints and over the fibres as line segments. Each
+// cell lists the xpoints in it and the fibres passing through it, except for
+// fibres spanning many cells, which are kept in a list of their own. Queries
+// look at the cells near the query, or at all occupied cells if those are
+// fewer. Coordinates are assumed to be within +-2^30, so that squared
+// distances fit in 64 bits.
+class SpatialIndex
+{
+public:
+    // Side of a cell
+    static int const CELL_SIZE = 16;
+    // Fibres spanning more cells than this are not put in the cells
+    static int const LONG_FIBRE_CELLS = 32;
+
+    void add_xpoint(Coord xy);
+    void remove_xpoint(Coord xy);
+    void add_fibre(Coord xpoint1, Coord xpoint2);
+    void remove_fibre(Coord xpoint1, Coord xpoint2);
+    void clear();
+
+    // All xpoints in Coord order
+    std::set<Coord> const& xpoints() const { return xpoints_; }
+
+    // The k xpoints nearest to xy, nearest first, equally near in Coord order
+    std::vector<Coord> nearest(Coord xy, std::size_t k) const;
+    // Xpoints in the rectangle with the given corners, borders included, in Coord order
+    std::vector<Coord> xpoints_in(Coord corner1, Coord corner2) const;
+    // Fibres with some part in the rectangle, in the order of all_fibres
+    std::vector<std::pair<Coord, Coord>> fibres_in(Coord corner1, Coord corner2) const;
+    // Fibres that cross or touch the segment from xy1 to xy2, in the order of all_fibres
+    std::vector<std::pair<Coord, Coord>> fibres_crossing(Coord xy1, Coord xy2) const;
+
+    void memory_usage(MemoryUsage& usage) const;
+
+private:
+    using Segment = std::pair<Coord, Coord>;
+
+    // Cells are identified by a Coord of their own
+    static Coord cell_of(Coord xy);
+    // Cells that the segment passes through, possibly with some neighbours
+    static std::vector<Coord> cells_of(Segment const& segment);
+    // Upper bound for the number of cells returned by cells_of
+    static double cell_span(Segment const& segment);
+
+    std::set<Coord> xpoints_;
+    std::unordered_map<Coord, std::vector<Coord>, CoordHash> xpoint_cells_;
+    std::unordered_map<Coord, std::vector<Segment>, CoordHash> fibre_cells_;
+    std::set<Segment> long_fibres_;
+};
+
+// Bookkeeping of a route search for one xpoint. Searches keep these in a
+// SearchState of their own, so they never modify the network itself.
+struct SearchNode
 {
-    Coord coords = NO_COORD;
-    std::unordered_map<Coord, std::pair<std::shared_ptr<Xpoint>, Cost>, CoordHash> fibres = {};
     State state = WHITE;
-    std::shared_ptr<Xpoint> pi = nullptr;
+    Coord pi = NO_COORD;
     Cost route_cost = 0;
     Cost d = INT_MAX;
 };
 
+using SearchState = std::unordered_map<Coord, SearchNode, CoordHash>;
+
+// Longest line accepted in a command file, in characters
+std::size_t const MAX_LINE_LENGTH = 64 * 1024;
+
+// Error found while ingesting a command file. Line numbers start from 1,
+// line 0 is for errors that concern the whole file.
+struct IngestError
+{
+    int line = 0;
+    std::string message = "";
+};
+
+// Number of latency histogram buckets. Bucket i counts calls that took
+// [2^i, 2^(i+1)) nanoseconds, the last bucket also counts anything slower.
+std::size_t const LATENCY_BUCKETS = 40;
+
+// Call, latency and work counters of one operation. Collected only when
+// compiled with DATASTRUCTURES_STATS defined.
+struct OperationStats
+{
+    unsigned long calls = 0;
+    unsigned long total_ns = 0;
+    std::array<unsigned long, LATENCY_BUCKETS> latency_histogram = {};
+    unsigned long nodes_settled = 0;   // route searches
+    unsigned long edges_relaxed = 0;   // route searches
+    unsigned long max_depth = 0;       // recursive operations
+    unsigned long entries_scanned = 0; // linear scans over beacons
+};
+
+// Snapshot of the statistics of all operations, keyed by operation name
+using Stats = std::map<std::string, OperationStats>;
+
 struct Prio_que_op
 {
-  // Operator for min-priority queue. Used in Dijkstra's-algorithm.
-    inline bool operator()(const std::shared_ptr<Xpoint> lhs, const std::shared_ptr<Xpoint> rhs)
+  // Operator for min-priority queue of (distance, xpoint). Used in Dijkstra's-algorithm.
+    inline bool operator()(const std::pair<Cost, Coord>& lhs, const std::pair<Cost, Coord>& rhs) const
     {
-        return lhs->d > rhs->d;
+        return lhs.first > rhs.first;
     }
 };
 
+// Which route a RouteSearch looks for: any route (depth-first) or the
+// fastest one (Dijkstra's algorithm).
+enum SearchKind { ANY_ROUTE, FASTEST_ROUTE };
+
+enum SearchStatus { SEARCHING, ROUTE_FOUND, NO_ROUTE, CANCELLED };
+
+// Route search that advances only when it is stepped, so it can be run in
+// slices with a budget, paused, resumed later or cancelled. The search reads
+// an immutable XpointMap; a handle made from a shared pointer keeps that map
+// alive by itself, so it stays valid while the network is modified.
+class RouteSearch
+{
+public:
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: only the start xpoint is queued
+    RouteSearch(std::shared_ptr<const XpointMap> xpoints, Coord fromxpoint, Coord toxpoint, SearchKind kind);
+
+    // As above, but the caller keeps xpoints alive and unmodified for the
+    // lifetime of the search.
+    RouteSearch(XpointMap const& xpoints, Coord fromxpoint, Coord toxpoint, SearchKind kind);
+
+    // Estimate of performance: O(k log V) for FASTEST_ROUTE, O(k) for ANY_ROUTE
+    // Short rationale for estimate: expands at most k = max_xpoints xpoints,
+    // plus their fibres
+    SearchStatus step(std::size_t max_xpoints);
+
+    // Estimate of performance: O(budget)
+    // Short rationale for estimate: steps in small slices until the search
+    // ends or the time budget is used up
+    SearchStatus step_for(std::chrono::microseconds budget);
+
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: only changes the status
+    void cancel();
+
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: returns a member
+    SearchStatus status() const;
+
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: returns a member
+    bool done() const;
+
+    // Cost of the best route to the target known so far, NO_COST if none is
+    // known yet. For FASTEST_ROUTE it only decreases while the search runs.
+    // Estimate of performance: Average case ϴ(1), worst case O(V)
+    // Short rationale for estimate: map.find() is constant on average
+    Cost best_bound() const;
+
+    // No route to the target can be cheaper than this. For ANY_ROUTE always 0.
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: returns a member
+    Cost lower_bound() const;
+
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: returns a member
+    std::size_t xpoints_expanded() const;
+
+    // The route in the same form as Datastructures::route_any/route_fastest,
+    // empty unless the status is ROUTE_FOUND.
+    // Estimate of performance: O(n)
+    // Short rationale for estimate: follows the route back from the target
+    std::vector<std::pair<Coord, Cost>> route() const;
+
+private:
+    // Expand one xpoint
+    void advance_any();
+    void advance_fastest();
+
+    std::shared_ptr<const XpointMap> owner_;
+    XpointMap const* xpoints_;
+    Coord from_;
+    Coord to_;
+    SearchKind kind_;
+    SearchStatus status_;
+    SearchState state_;
+    std::stack<Coord> stack_; // ANY_ROUTE
+    std::priority_queue<std::pair<Cost, Coord>, std::vector<std::pair<Cost, Coord>>, Prio_que_op> min_queue_; // FASTEST_ROUTE
+    Cost lower_bound_;
+    std::size_t expanded_;
+};
+
+// Immutable view of the beacons and fibres, published by
+// Datastructures::publish(). Any number of threads may query the same
+// snapshot concurrently, also while the Datastructures is being modified.
+//
+// The hub trees and the spatial index are not published, so all_hubs,
+// route_from_hub and the spatial queries can only be asked from the
+// Datastructures, by the writer. Snapshot queries are not instrumented.
+class Snapshot
+{
+public:
+    Snapshot(std::shared_ptr<const BeaconStore> beacons, std::shared_ptr<const XpointMap> xpoints);
+
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: the id index keeps its size
+    int beacon_count() const;
+
+    // Estimate of performance: O(n)
+    // Short rationale for estimate: looping through the rows
+    std::vector<BeaconID> all_beacons() const;
+
+    // Estimate of performance: Average case ϴ(1), worst case O(n)
+    // Short rationale for estimate: a lookup in the id index, a hash table
+    // with linear probing, is constant on average
+    std::string get_name(BeaconID id) const;
+
+    // Estimate of performance: Average case ϴ(1), worst case O(n)
+    // Short rationale for estimate: a lookup in the id index, a hash table
+    // with linear probing, is constant on average
+    Coord get_coordinates(BeaconID id) const;
+
+    // Estimate of performance: Average case ϴ(1), worst case O(n)
+    // Short rationale for estimate: a lookup in the id index, a hash table
+    // with linear probing, is constant on average
+    Color get_color(BeaconID id) const;
+
+    // Estimate of performance: O(n)
+    // Short rationale for estimate: walks the name order
+    std::vector<BeaconID> beacons_alphabetically() const;
+
+    // Estimate of performance: O(n)
+    // Short rationale for estimate: walks the brightness order
+    std::vector<BeaconID> beacons_brightness_increasing() const;
+
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: the ends of the brightness order are kept
+    BeaconID min_brightness() const;
+
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: the ends of the brightness order are kept
+    BeaconID max_brightness() const;
+
+    // Estimate of performance: O(log n + k log k)
+    // Short rationale for estimate: the name order is searched in
+    // logarithmic time, then the k found ids are sorted
+    std::vector<BeaconID> find_beacons(std::string const& name) const;
+
+    // Estimate of performance: O(d)
+    // Short rationale for estimate: the d sources are already in id order
+    std::vector<BeaconID> get_lightsources(BeaconID id) const;
+
+    // Estimate of performance: O(k log k + log n)
+    // Short rationale for estimate: the k sources are listed from the
+    // lightbeam index, then sorted
+    std::vector<BeaconID> get_all_lightsources(BeaconID id) const;
+
+    // Estimate of performance: O(log n) on average
+    // Short rationale for estimate: positions of two tokens in the lightbeam index
+    int count_all_lightsources(BeaconID id) const;
+
+    // Estimate of performance: O(log n) on average
+    // Short rationale for estimate: positions of three tokens in the lightbeam index
+    bool is_upstream(BeaconID upstreamid, BeaconID downstreamid) const;
+
+    // Estimate of performance: O(n)
+    // Short rationale for estimate: iterating through targets
+    std::vector<BeaconID> path_outbeam(BeaconID id) const;
+
+    // Estimate of performance: O(n)
+    // Short rationale for estimate: visits each upstream beacon once
+    std::vector<BeaconID> path_inbeam_longest(BeaconID id) const;
+
+    // Estimate of performance: O(n)
+    // Short rationale for estimate: visits each upstream beacon once
+    Color total_color(BeaconID id) const;
+
+    // Estimate of performance: O(n + k log k)
+    // Short rationale for estimate: a scan over all packed colors, then
+    // sorting the k found ids
+    std::vector<BeaconID> find_beacons_by_color(Color target, int max_distance) const;
+
+    // Estimate of performance: O(n log k)
+    // Short rationale for estimate: a scan over all packed colors, keeping
+    // the k nearest in a heap
+    std::vector<BeaconID> nearest_color(Color target, int k) const;
+
+    // Estimate of performance: O(n + b)
+    // Short rationale for estimate: one pass over the brightnesses into b buckets
+    std::vector<int> brightness_histogram(int buckets) const;
+
+    // Estimate of performance: O(n log n)
+    // Short rationale for estimate: Looping through all xpoints and then sorting them.
+    std::vector<Coord> all_xpoints() const;
+
+    // Estimate of performance: O(n log n)
+    // Short rationale for estimate: Looping through all fibres from a xpoint and sorting them.
+    std::vector<std::pair<Coord, Cost>> get_fibres_from(Coord xpoint) const;
+
+    // Estimate of performance: O(n log n)
+    // Short rationale for estimate: collects each fibre once from the xpoints,
+    // then sorts them
+    std::vector<std::pair<Coord, Coord>> all_fibres() const;
+
+    // Estimate of performance: O(V+E)
+    // Short rationale for estimate: Depth-first-search with a search state of its own
+    std::vector<std::pair<Coord, Cost>> route_any(Coord fromxpoint, Coord toxpoint) const;
+
+    // Estimate of performance: O(V+E)
+    // Short rationale for estimate: Breath-first-search with a search state of its own
+    std::vector<std::pair<Coord, Cost>> route_least_xpoints(Coord fromxpoint, Coord toxpoint) const;
+
+    // Estimate of performance: O((V+E) log V)
+    // Short rationale for estimate: Dijkstra's algorithm with a search state of its own
+    std::vector<std::pair<Coord, Cost>> route_fastest(Coord fromxpoint, Coord toxpoint) const;
+
+    // Estimate of performance: O(V+E)
+    // Short rationale for estimate: Depth-first-search with a search state of its own
+    std::vector<Coord> route_fibre_cycle(Coord startxpoint) const;
+
+    // Estimate of performance: O(k L (V+E) log V)
+    // Short rationale for estimate: Yen's algorithm with up to L spur searches
+    // for each of the k routes, L is the length of a route
+    std::vector<std::vector<std::pair<Coord, Cost>>> route_k_fastest(Coord fromxpoint, Coord toxpoint, int k) const;
+
+    // Estimate of performance: O(r L (V+E) log V)
+    // Short rationale for estimate: Yen's algorithm until the r routes within
+    // the cost are found
+    std::vector<std::vector<std::pair<Coord, Cost>>> routes_within_cost(Coord fromxpoint, Coord toxpoint, Cost max_cost) const;
+
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: the search shares the fibres of the snapshot
+    RouteSearch begin_route_search(Coord fromxpoint, Coord toxpoint, SearchKind kind) const;
+
+private:
+    std::shared_ptr<const BeaconStore> beacons_;
+    std::shared_ptr<const XpointMap> xpoints_;
+};
+
 // This is the class you are supposed to implement
 class Datastructures
 {
@@ -127,72 +1005,85 @@ public:
     Datastructures();
     ~Datastructures();
 
+    // Readers hold snapshots of one Datastructures, copies are not needed
+    Datastructures(Datastructures const&) = delete;
+    Datastructures& operator=(Datastructures const&) = delete;
+
     // Estimate of performance: O(1)
-    // Short rationale for estimate: map.size() is constant
+    // Short rationale for estimate: the id index keeps its size
     int beacon_count();
 
     // Estimate of performance: O(n)
-    // Short rationale for estimate: map.clear() is linear in the size
+    // Short rationale for estimate: releases every page of the beacon columns
     void clear_beacons();
 
     // Estimate of performance: O(n)
-    // Short rationale for estimate: looping through a map
+    // Short rationale for estimate: looping through the rows
     std::vector<BeaconID> all_beacons();
 
     // Estimate of performance: O(log n)
-    // Short rationale for estimate: multimap.insert() is logarithmic in size, the method adds only one item
+    // Short rationale for estimate: the row is inserted into the name and
+    // brightness orders in logarithmic time
+    // Color channels must be 0..255.
     bool add_beacon(BeaconID id, std::string const& name, Coord xy, Color color);
 
     // Estimate of performance: Average case ϴ(1), worst case O(n)
-    // Short rationale for estimate: map.find() is constant on average
+    // Short rationale for estimate: a lookup in the id index, a hash table
+    // with linear probing, is constant on average
     std::string get_name(BeaconID id);
 
     // Estimate of performance: Average case ϴ(1), worst case O(n)
-    // Short rationale for estimate: map.find() is constant on average
+    // Short rationale for estimate: a lookup in the id index, a hash table
+    // with linear probing, is constant on average
     Coord get_coordinates(BeaconID id);
 
     // Estimate of performance: Average case ϴ(1), worst case O(n)
-    // Short rationale for estimate: map.find() is constant on average
+    // Short rationale for estimate: a lookup in the id index, a hash table
+    // with linear probing, is constant on average
     Color get_color(BeaconID id);
 
     // We recommend you implement the operations below only after implementing the ones above
 
     // Estimate of performance: O(n)
-    // Short rationale for estimate: looping through a map, reserving memory for a vector
+    // Short rationale for estimate: walks the name order, reserving memory for a vector
     std::vector<BeaconID> beacons_alphabetically();
 
    // Estimate of performance: O(n)
-    // Short rationale for estimate: looping through a map, reserving memory for a vector
+    // Short rationale for estimate: walks the brightness order, reserving memory for a vector
     std::vector<BeaconID> beacons_brightness_increasing();
 
     // Estimate of performance: O(1)
-    // Short rationale for estimate: map.begin() is constant
+    // Short rationale for estimate: the ends of the brightness order are kept
     BeaconID min_brightness();
 
     // Estimate of performance: O(1)
-    // Short rationale for estimate: map.rbegin() is constant
+    // Short rationale for estimate: the ends of the brightness order are kept
     BeaconID max_brightness();
 
-    // Estimate of performance: O(n log n)
-    // Short rationale for estimate: looping through a map and then sorting found ids
+    // Estimate of performance: O(log n + k log k)
+    // Short rationale for estimate: the name order is searched in
+    // logarithmic time, then the k found ids are sorted
     std::vector<BeaconID> find_beacons(std::string const& name);
 
-    // Estimate of performance: best case Ω(log n), worst case O(n)
-    // Short rationale for estimate: equal_range is logarithmic in size, then looping through the found range
+    // Estimate of performance: O(log n)
+    // Short rationale for estimate: the row is moved in the name order
     bool change_beacon_name(BeaconID id, std::string const& newname);
 
-     // Estimate of performance: best case Ω(log n), worst case O(n)
-    // Short rationale for estimate: equal_range is logarithmic in size, then looping through the found range
+    // Estimate of performance: O(log n)
+    // Short rationale for estimate: the row is moved in the brightness order
+    // Color channels must be 0..255.
     bool change_beacon_color(BeaconID id, Color newcolor);
 
     // We recommend you implement the operations below only after implementing the ones above
 
-    // Estimate of performance: Average case ϴ(1), worst case O(n)
-    // Short rationale for estimate: map.find() is constant on average
+    // Estimate of performance: O(d + log n) on average
+    // Short rationale for estimate: the source is inserted in id order among
+    // the d sources of the target, and the lightbeam index is split and
+    // merged once. Lightbeams that would close a loop are rejected.
     bool add_lightbeam(BeaconID sourceid, BeaconID targetid);
 
-    // Estimate of performance: O(n log n)
-    // Short rationale for estimate: sorting a vector
+    // Estimate of performance: O(d)
+    // Short rationale for estimate: the d sources are already in id order
     std::vector<BeaconID> get_lightsources(BeaconID id);
 
     // Estimate of performance: O(n)
@@ -201,27 +1092,64 @@ public:
 
     // Non-compulsory operations
 
-    // Estimate of performance: O(n)
-    // Short rationale for estimate: removing an item from maps/vectors
+    // Estimate of performance: O((d + 1) log n) on average
+    // Short rationale for estimate: erasing a row from the orders is
+    // logarithmic, each of the d sources and the target is unlinked from the
+    // lightbeam index in logarithmic time
     bool remove_beacon(BeaconID id);
 
     // Estimate of performance: O(n)
-    // Short rationale for estimate: calls path_inbeam_recursive which calls itself for each source, then converts the deque into vector
+    // Short rationale for estimate: inbeam_path_recursive calls itself for
+    // each source, then the deque is converted into a vector
     std::vector<BeaconID> path_inbeam_longest(BeaconID id);
 
     // Estimate of performance: O(n)
     // Short rationale for estimate: the method calls itself for each source
     Color total_color(BeaconID id);
 
+    // Transitive lightsources, answered from the lightbeam index
+
+    // Estimate of performance: O(k log k + log n)
+    // Short rationale for estimate: the k sources are listed from the
+    // lightbeam index, then sorted
+    std::vector<BeaconID> get_all_lightsources(BeaconID id);
+
+    // Estimate of performance: O(log n) on average
+    // Short rationale for estimate: positions of two tokens in the lightbeam index
+    int count_all_lightsources(BeaconID id);
+
+    // Estimate of performance: O(log n) on average
+    // Short rationale for estimate: positions of three tokens in the lightbeam index
+    bool is_upstream(BeaconID upstreamid, BeaconID downstreamid);
+
+    // Color queries. Color distance is Euclidean distance in RGB space.
+
+    // Estimate of performance: O(n + k log k)
+    // Short rationale for estimate: a vectorized scan over all packed colors,
+    // then sorting the k found ids
+    std::vector<BeaconID> find_beacons_by_color(Color target, int max_distance);
+
+    // Estimate of performance: O(n log k)
+    // Short rationale for estimate: a vectorized scan over all packed colors,
+    // keeping the k nearest in a heap
+    std::vector<BeaconID> nearest_color(Color target, int k);
+
+    // Estimate of performance: O(n + b)
+    // Short rationale for estimate: one pass over the cached brightnesses into
+    // b buckets splitting brightnesses 0..MAX_BRIGHTNESS evenly
+    std::vector<int> brightness_histogram(int buckets);
+
     // Phase 2 operations
 
-    // Estimate of performance: O(n log n)
-    // Short rationale for estimate: Looping through all xpoints and then sorting them.
+    // Estimate of performance: O(n)
+    // Short rationale for estimate: copies the xpoints from the spatial index,
+    // which keeps them sorted
     std::vector<Coord> all_xpoints();
 
     // Estimate of performance: ϴ(log n) on average, O(n) worst case
     // Short rationale for estimate: Inserting into a set is logaritmic,
-    // finding from unordered_map is linear in worst case.
+    // finding from unordered_map is linear in worst case. Hub trees are
+    // repaired as in update_fibre_cost. Negative costs are rejected.
     bool add_fibre(Coord xpoint1, Coord xpoint2, Cost cost);
 
     // Estimate of performance: O(n)
@@ -233,7 +1161,8 @@ public:
     std::vector<std::pair<Coord, Coord>> all_fibres();
 
     // Estimate of performance: O(n log n)
-    // Short rationale for estimate: Removing from a set is n log n.
+    // Short rationale for estimate: Removing from a set is n log n. Hub trees
+    // are repaired as in update_fibre_cost.
     bool remove_fibre(Coord xpoint1, Coord xpoint2);
 
     // Estimate of performance: O(n)
@@ -266,6 +1195,159 @@ public:
     // Short rationale for estimate:
     Cost trim_fibre_network();
 
+    // Resumable route searches. The handle searches a published copy of the
+    // fibres, so later changes to the network do not affect it.
+
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: the search gets a copy of the fibres,
+    // which shares all its pages with the network
+    RouteSearch begin_route_search(Coord fromxpoint, Coord toxpoint, SearchKind kind);
+
+    // Fibre costs and hub trees. A hub is an xpoint whose shortest-path tree
+    // is kept up to date as fibres are added, removed or change cost, so
+    // fastest routes from it are only looked up. Only the part of a tree
+    // whose distances change is recomputed. A hub stops being one when its
+    // xpoint loses its last fibre or the fibres are cleared. Fibre costs are
+    // never negative, add_fibre and update_fibre_cost return false for a
+    // negative cost.
+
+    // Estimate of performance: O(h * a log a), a is the size of the affected
+    // part of each of the h hub trees
+    // Short rationale for estimate: the cost is changed in place, the hub
+    // trees are repaired only where their distances change
+    bool update_fibre_cost(Coord xpoint1, Coord xpoint2, Cost cost);
+
+    // Estimate of performance: O((V+E) log V)
+    // Short rationale for estimate: the tree is built with Dijkstra's algorithm
+    bool add_hub(Coord xpoint);
+
+    // Estimate of performance: Average case ϴ(V), worst case O(V)
+    // Short rationale for estimate: destroys the tree of the hub
+    bool remove_hub(Coord xpoint);
+
+    // Estimate of performance: O(h log h)
+    // Short rationale for estimate: collects and sorts the h registered hubs
+    std::vector<Coord> all_hubs();
+
+    // Estimate of performance: Average case ϴ(r), r is the length of the route
+    // Short rationale for estimate: follows the tree of the hub back from the target
+    std::vector<std::pair<Coord, Cost>> route_from_hub(Coord hubxpoint, Coord toxpoint);
+
+    // Spatial queries, answered from a grid index over the xpoints and the
+    // fibres. Distance is Euclidean distance. Here c is the number of grid
+    // cells looked at, at most the number of occupied cells, and m the number
+    // of xpoints or fibres in them.
+
+    // Estimate of performance: O(c + m)
+    // Short rationale for estimate: looks at rings of cells around xy until
+    // no nearer xpoint can remain
+    Coord nearest_xpoint(Coord xy);
+
+    // Estimate of performance: O(c + m log k)
+    // Short rationale for estimate: rings of cells around xy, keeping the k
+    // nearest xpoints in a heap
+    std::vector<Coord> nearest_xpoints(Coord xy, int k);
+
+    // Estimate of performance: O(c + m log m)
+    // Short rationale for estimate: the cells covering the rectangle, then
+    // sorting the xpoints found
+    std::vector<Coord> xpoints_in_rectangle(Coord corner1, Coord corner2);
+
+    // Estimate of performance: O(c + m log m)
+    // Short rationale for estimate: the cells covering the rectangle, each
+    // fibre is tested against the rectangle and kept in a set
+    std::vector<std::pair<Coord, Coord>> fibres_in_rectangle(Coord corner1, Coord corner2);
+
+    // Estimate of performance: O(c + m log m)
+    // Short rationale for estimate: the cells along the segment, each fibre
+    // is tested against the segment and kept in a set
+    std::vector<std::pair<Coord, Coord>> fibres_crossing(Coord xy1, Coord xy2);
+
+    // Alternative routes. Routes are loopless and listed cheapest first, each
+    // in the same form as route_fastest returns.
+
+    // Estimate of performance: O(k L (V+E) log V)
+    // Short rationale for estimate: Yen's algorithm with up to L spur searches
+    // for each of the k routes, L is the length of a route. The spur searches
+    // of a route run in parallel and reuse one shortest-path tree from the
+    // target, so most of them finish without searching.
+    std::vector<std::vector<std::pair<Coord, Cost>>> route_k_fastest(Coord fromxpoint, Coord toxpoint, int k);
+
+    // Every route costing at most max_cost. There can be exponentially many.
+    // Estimate of performance: O(r L (V+E) log V)
+    // Short rationale for estimate: Yen's algorithm until the r routes within
+    // the cost are found
+    std::vector<std::vector<std::pair<Coord, Cost>>> routes_within_cost(Coord fromxpoint, Coord toxpoint, Cost max_cost);
+
+    // Bulk loading. Each line holds one add_beacon, add_lightbeam or add_fibre
+    // command. Lines longer than MAX_LINE_LENGTH characters are reported and
+    // skipped.
+
+    // Estimate of performance: O(n log n)
+    // Short rationale for estimate: lines are parsed in parallel chunk by chunk,
+    // and the parsed commands are applied in file order. A run of beacons is
+    // added at once and the orders rebuilt after it when that is cheaper,
+    // other commands are logarithmic add operations.
+    std::vector<IngestError> ingest_stream(std::istream& input);
+
+    // Estimate of performance: O(n log n)
+    // Short rationale for estimate: opens the file and calls ingest_stream
+    std::vector<IngestError> ingest_file(std::string const& filename);
+
+    // Batched mutations. Between begin_batch() and commit() the calls to
+    // change_beacon_name, change_beacon_color, add_lightbeam and remove_fibre
+    // are validated against the pending changes and buffered, and queries see
+    // the state before the batch. add_beacon, remove_beacon, clear_beacons,
+    // add_fibre, update_fibre_cost, clear_fibres and ingest_stream change
+    // nothing while a batch is open, and make commit() fail. Batches do not
+    // nest: begin_batch() while a batch is open also makes commit() fail.
+
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: only marks the batch open
+    void begin_batch();
+
+    // Estimate of performance: O(k log n) or O(n log n), whichever is smaller
+    // Short rationale for estimate: k buffered changes are either moved one
+    // by one in the orders, or the orders are rebuilt once from scratch
+    bool commit();
+
+    // Estimate of performance: O(k)
+    // Short rationale for estimate: clears the buffered changes
+    void rollback();
+
+    // Concurrent readers. A single writer thread modifies the Datastructures
+    // and calls publish(), reader threads take snapshot() and query it.
+
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: the snapshot shares all pages of the
+    // beacons and fibres; the writer copies a page when it next changes it
+    void publish();
+
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: atomically loads a shared pointer
+    std::shared_ptr<const Snapshot> snapshot();
+
+    // Estimate of performance: O(n)
+    // Short rationale for estimate: sums the sizes of all structures
+    MemoryUsage memory_usage();
+
+    // Instrumentation. Without DATASTRUCTURES_STATS nothing is recorded and
+    // stats() is always empty. Only the operations of Datastructures are
+    // counted: queries on a Snapshot run in reader threads and would race on
+    // the counters, so they are not timed.
+
+    // Estimate of performance: O(k)
+    // Short rationale for estimate: copies the stats of k operations
+    Stats stats();
+
+    // Estimate of performance: O(k)
+    // Short rationale for estimate: prints one line per operation
+    void print_stats(std::ostream& output);
+
+    // Estimate of performance: O(k)
+    // Short rationale for estimate: map.clear() is linear in the size
+    void reset_stats();
+
 private:
     // Add stuff needed for your class implementation here
 
@@ -273,38 +1355,58 @@ private:
     // Calculates the brightness of a color
     int get_brightness(Color color);
 
-    // Recursive implementation for path_inbeam_longest
-    void path_inbeam_recursive(BeaconID id, std::deque<BeaconID> atm, std::deque<BeaconID> &longest);
-
-    std::unordered_map<BeaconID, Beacon> beacons_;
-    std::multimap<std::string, BeaconID> alphabetical_order_;
-    std::multimap<int, BeaconID> brightness_order_;
+    BeaconStore beacons_;
 
     // prg2 stuff
+    // The route searches themselves are free functions in datastructures.cc,
+    // shared with Snapshot.
 
-    // Resets all xpoints
-    void reset_xpoints();
-
-    // Depth-first-search algorithm, which returns true if target node or a
-    // loop is found, depending on which is needed.
-    bool DFS(std::shared_ptr<Xpoint> from, std::shared_ptr<Xpoint> to,
-             bool find_cycle, std::pair<std::shared_ptr<Xpoint>, std::shared_ptr<Xpoint>>& cycle_begin);
-
-    // Breath-first-search algorithm
-    void BFS(std::shared_ptr<Xpoint> from);
+    // Removes a fibre from both of its xpoints and removes the xpoints that
+    // have no fibres left, and their hubs. Repairs the other hub trees. Does
+    // not touch fibres_.
+    void erase_fibre_ends(Coord xpoint1, Coord xpoint2);
 
-    // Dijkstra's algorithm
-    void dijkstra(std::shared_ptr<Xpoint> from);
-
-    // Relax -function used in Dijkstra's.
-    void relax(std::shared_ptr<Xpoint>, std::shared_ptr<Xpoint>, Cost);
+    XpointMap xpoints_;
+    std::set<std::pair<Coord, Coord>> fibres_;
+    // Same xpoints and fibres as above, by location
+    SpatialIndex spatial_;
 
-    // Route-collecting algorithm that collects a route stored in xpoints
-    // pi-pointers.
-    void collect_route(std::vector<std::pair<Coord, Cost>>& route, std::shared_ptr<Xpoint> to);
+    // Shortest-path tree of each hub. The hub itself is always in its tree,
+    // other xpoints only while they can be reached from the hub.
+    std::unordered_map<Coord, SearchState, CoordHash> hub_trees_;
 
-    std::unordered_map<Coord, std::shared_ptr<Xpoint>, CoordHash> xpoints_;
-    std::set<std::pair<Coord, Coord>> fibres_;
+    // Batched mutations
+    // Changes buffered since begin_batch(), applied by commit()
+    struct Batch
+    {
+        bool open = false;
+        bool failed = false; // Some buffered call was invalid, commit() applies nothing
+        std::unordered_map<BeaconID, std::string> names = {};
+        std::unordered_map<BeaconID, Color> colors = {};
+        std::vector<std::pair<BeaconID, BeaconID>> lightbeams = {};
+        std::unordered_set<BeaconID> new_sources = {};
+        std::set<std::pair<Coord, Coord>> removed_fibres = {};
+    };
+    Batch batch_;
+
+    // Checks that the ids and fibres in the batch still exist
+    bool batch_still_valid(Batch const& batch);
+
+    // Marks the open batch failed, if there is one. Returns false.
+    bool batch_reject();
+
+    // Concurrent readers
+    // Latest published snapshot, accessed only with std::atomic_load/store
+    std::shared_ptr<const Snapshot> snapshot_;
+    // Copies of beacons_ and xpoints_ in snapshot_, reset when the originals change
+    std::shared_ptr<const BeaconStore> published_beacons_;
+    std::shared_ptr<const XpointMap> published_xpoints_;
+
+    // Returns published_xpoints_, copying xpoints_ first if it is out of date
+    std::shared_ptr<const XpointMap> published_fibres();
+
+    // Instrumentation
+    Stats stats_;
 
 };
 
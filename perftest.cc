@@ -0,0 +1,812 @@
+// Perftest.cc
+//
+// Scaling benchmark for every public operation of Datastructures.
+// Builds synthetic beacon forests and fibre networks of growing size,
+// measures ns/op and allocations/op for each operation, fits a growth
+// exponent over the sizes and flags operations whose measured growth
+// exceeds the "Estimate of performance" declared in datastructures.hh.
+//
+// The declared exponents are read from the header. The input sizes n, V and
+// E count with exponent 1 and a logarithm with 0.1. Every other quantity in
+// an estimate, such as the number of results, the length of a route or the
+// size of the affected part of a hub tree, the benchmark keeps bounded as n
+// grows, so it counts as a constant.
+//
+// Every size is measured several times and the median is kept. The growth
+// exponent is fitted over the sizes within a factor of ten of the largest,
+// where fixed per-call costs no longer hide it, as the median of the slopes
+// between all pairs of those sizes, so one disturbed size does not skew it.
+// Random memory accesses get slower as the working set outgrows the caches
+// and the TLB, which makes even O(1) operations seem to grow; a reference
+// operation, a chain of random reads in a buffer as large as the beacon
+// structures, measures how much on this machine. That much growth, up to
+// MAX_REFERENCE_SLACK, is allowed on top of the declared exponent of the
+// operations that grow slower than linearly.
+//
+// Operations whose own working set outgrows the caches later than the
+// reference, such as route searches, can still exceed the declared exponent
+// on some machines. A run saved with --json can be given as a baseline;
+// operations whose exponent grew by more than the tolerance since then are
+// flagged as regressions.
+//
+// Usage: perftest [max_size] [--repeats r] [--baseline file] [--header file] [--json]
+//   max_size   largest size to measure, between 10^3 and 10^7 (default 10^6).
+//              Sizes go 1000, 2000, 5000, 10000, ... up to max_size.
+//   --repeats  how many times each size is measured (default 3)
+//   --baseline earlier output of perftest --json to compare against
+//   --header   datastructures.hh to read the declared complexities from
+//              (default: the one next to this source file)
+//   --json     print machine-readable results instead of a table
+
+#include "datastructures.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+
+// ---------------------------- Allocation counting ---------------------------
+
+static std::atomic<unsigned long> allocations(0);
+
+// The replacements are kept out of line. Inlined into the containers, they
+// make GCC pair the malloc of one with the operator delete of the other and
+// warn about a mismatch.
+[[gnu::noinline]] void* operator new(std::size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* ptr = std::malloc(size == 0 ? 1 : size)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+[[gnu::noinline]] void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+[[gnu::noinline]] void operator delete(void* ptr, std::size_t) noexcept
+{
+    std::free(ptr);
+}
+
+// ----------------------------------------------------------------------------
+
+namespace {
+
+// Minimum time spent measuring one operation at one size, and the cap on
+// repetitions for the fast operations.
+std::chrono::milliseconds const MIN_MEASURE_TIME(20);
+unsigned int const MAX_REPS = 100000;
+
+// Hubs registered in the fibre benchmark
+unsigned int const HUBS = 4;
+
+// Changes buffered in the benchmarked commit
+unsigned int const COMMIT_CHANGES = 1000;
+
+// Span of the grid within which the operations whose cost depends on a route
+// length, or on the part of a hub tree a change affects, are asked about, so
+// that those stay bounded as the grid grows
+int const NEAR = 10;
+
+// Measured growth is allowed to exceed the declared one by this much before
+// the operation is flagged.
+double const EXPONENT_TOLERANCE = 0.25;
+// Operations declared to grow slower than linearly are dominated by random
+// memory accesses, and are allowed the growth of the reference operation on
+// top, up to this much. Scans read memory in order and get no such slack.
+double const MAX_REFERENCE_SLACK = 0.5;
+
+unsigned int const DEFAULT_REPEATS = 3;
+
+// Name of the reference operation, which is not declared in the header
+std::string const REFERENCE_OP = "reference_reads";
+unsigned int const REFERENCE_READS = 3;
+// Keeps the reference reads from being optimized away
+volatile std::size_t reference_sink = 0;
+
+struct Declared
+{
+    std::string complexity;
+    // Growth in n, none for operations that declare no complexity
+    double exponent;
+    bool has_exponent;
+};
+
+// Exponent given to a logarithmic factor
+double const LOG_EXPONENT = 0.1;
+
+// Growth exponent of a complexity expression such as "(V+E) log V" or
+// "k log k + log n". The input sizes n, V and E grow with exponent 1. The
+// other quantities, such as result sizes, route lengths and parameters, the
+// benchmark keeps bounded, so they count as constants.
+class ExponentParser
+{
+public:
+    explicit ExponentParser(std::string const& expression) : text_(expression) {}
+
+    double parse()
+    {
+        double exponent = sum();
+        if (pos_ != text_.size()) {
+            throw std::runtime_error("cannot read complexity " + text_);
+        }
+        return exponent;
+    }
+
+private:
+    // Terms add up, the fastest growing one counts
+    double sum()
+    {
+        double exponent = product();
+        while (symbol('+')) {
+            exponent = std::max(exponent, product());
+        }
+        return exponent;
+    }
+
+    // Factors multiply, written side by side or with *
+    double product()
+    {
+        double exponent = factor();
+        while (true) {
+            skip_space();
+            if (pos_ == text_.size() or text_[pos_] == '+' or text_[pos_] == ')') {
+                return exponent;
+            }
+            symbol('*');
+            exponent += factor();
+        }
+    }
+
+    double factor()
+    {
+        skip_space();
+        if (symbol('(')) {
+            double exponent = sum();
+            if (!symbol(')')) {
+                throw std::runtime_error("unbalanced parentheses in complexity " + text_);
+            }
+            return exponent;
+        }
+        auto start = pos_;
+        while (pos_ < text_.size() and std::isalnum(static_cast<unsigned char>(text_[pos_]))) {
+            ++pos_;
+        }
+        auto word = text_.substr(start, pos_ - start);
+        if (word.empty()) {
+            throw std::runtime_error("cannot read complexity " + text_);
+        }
+        if (word == "log") {
+            return factor() > 0 ? LOG_EXPONENT : 0.0;
+        }
+        return (word == "n" or word == "V" or word == "E") ? 1.0 : 0.0;
+    }
+
+    bool symbol(char c)
+    {
+        skip_space();
+        if (pos_ < text_.size() and text_[pos_] == c) {
+            ++pos_;
+            return true;
+        }
+        return false;
+    }
+
+    void skip_space()
+    {
+        while (pos_ < text_.size() and text_[pos_] == ' ') {
+            ++pos_;
+        }
+    }
+
+    std::string text_;
+    std::size_t pos_ = 0;
+};
+
+// The first complexity in an "Estimate of performance" comment, such as
+// "O(log n)" in "O(log n) on average", or "ϴ(1)" in "Average case ϴ(1),
+// worst case O(n)". Where the comment gives the smaller of two, both count.
+Declared parse_estimate(std::string const& estimate)
+{
+    std::vector<double> exponents;
+    std::string first;
+    std::size_t pos = 0;
+    while (true) {
+        auto o = estimate.find("O(", pos);
+        auto theta = estimate.find("ϴ(", pos);
+        auto start = std::min(o, theta);
+        if (start == std::string::npos) {
+            break;
+        }
+        auto open = estimate.find('(', start);
+        auto close = open;
+        for (int depth = 0; close < estimate.size(); ++close) {
+            depth += (estimate[close] == '(') - (estimate[close] == ')');
+            if (depth == 0) {
+                break;
+            }
+        }
+        if (close == estimate.size()) {
+            throw std::runtime_error("unbalanced parentheses in estimate " + estimate);
+        }
+        if (first.empty()) {
+            first = estimate.substr(start, close + 1 - start);
+        }
+        exponents.push_back(ExponentParser(estimate.substr(open + 1, close - open - 1)).parse());
+        if (estimate.find("whichever is smaller") == std::string::npos) {
+            break;
+        }
+        pos = close + 1;
+    }
+    if (exponents.empty()) {
+        return {estimate, 0.0, false};
+    }
+    return {first, *std::min_element(exponents.begin(), exponents.end()), true};
+}
+
+// Declared complexities of the operations of Datastructures, read from the
+// "Estimate of performance" comment above each of them in the header
+std::map<std::string, Declared> read_declared(std::string const& filename)
+{
+    std::ifstream input(filename);
+    if (!input) {
+        throw std::runtime_error("cannot open header " + filename);
+    }
+    std::string const estimate_key = "// Estimate of performance:";
+    std::map<std::string, Declared> declared;
+    std::string line;
+    bool in_class = false;
+    std::string estimate;
+    while (std::getline(input, line)) {
+        if (line.rfind("class Datastructures", 0) == 0) {
+            in_class = true;
+        }
+        auto key = line.find(estimate_key);
+        if (!in_class) {
+            continue;
+        } else if (key != std::string::npos) {
+            estimate = line.substr(key + estimate_key.size() + 1);
+        } else if (!estimate.empty() and line.find("//") == std::string::npos and line.find('(') != std::string::npos) {
+            // The declaration: the operation is the name before its parameters
+            auto end = line.find('(');
+            auto start = line.find_last_of(" *&>", end) + 1;
+            declared[line.substr(start, end - start)] = parse_estimate(estimate);
+            estimate.clear();
+        }
+    }
+    return declared;
+}
+
+// The header next to this source file, unless --header gives another
+std::string default_header()
+{
+    std::string source = __FILE__;
+    auto slash = source.find_last_of('/');
+    return (slash == std::string::npos ? "" : source.substr(0, slash + 1)) + "datastructures.hh";
+}
+
+struct Sample
+{
+    std::string op;
+    unsigned int n;
+    double ns_per_op;
+    double allocs_per_op;
+    double gb_per_s;
+};
+
+std::vector<Sample> samples;
+
+// Calls fn(i) for i = 0, 1, ... until MIN_MEASURE_TIME has passed or
+// max_reps calls have been made, and records the averages. Every repeat of a
+// size adds a sample of its own.
+void measure(std::string const& op, unsigned int n, unsigned int max_reps,
+             std::function<void(unsigned int)> const& fn, std::size_t bytes = 0)
+{
+    using clock = std::chrono::steady_clock;
+    auto allocs_before = allocations.load();
+    auto start = clock::now();
+    auto elapsed = clock::duration::zero();
+    unsigned int reps = 0;
+    while (reps < max_reps and (reps == 0 or elapsed < MIN_MEASURE_TIME)) {
+        fn(reps);
+        ++reps;
+        elapsed = clock::now() - start;
+    }
+    double ns = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    double allocs = static_cast<double>(allocations.load() - allocs_before);
+    double gbps = bytes == 0 ? 0.0 : static_cast<double>(bytes) * reps / ns;
+    samples.push_back({op, n, ns / reps, allocs / reps, gbps});
+}
+
+BeaconID beacon_id(unsigned int i)
+{
+    return "B" + std::to_string(i);
+}
+
+std::string random_name()
+{
+    std::string name;
+    auto length = random_in_range(3, 10);
+    for (int i = 0; i < length; ++i) {
+        name += random_in_range('a', 'z');
+    }
+    return name;
+}
+
+Color random_color()
+{
+    return {random_in_range(0, 255), random_in_range(0, 255), random_in_range(0, 255)};
+}
+
+Coord random_coord()
+{
+    return {random_in_range(0, 10000), random_in_range(0, 10000)};
+}
+
+// Adds n beacons in a random forest: each beacon sends its beam to a random
+// earlier beacon, except for roughly one in a hundred which stay roots.
+void build_beacons(Datastructures& ds, unsigned int n)
+{
+    for (unsigned int i = 0; i < n; ++i) {
+        ds.add_beacon(beacon_id(i), random_name(), random_coord(), random_color());
+    }
+    for (unsigned int i = 1; i < n; ++i) {
+        if (random_in_range(0, 99) != 0) {
+            ds.add_lightbeam(beacon_id(i), beacon_id(random_in_range(0u, i - 1)));
+        }
+    }
+}
+
+// Adds a side x side grid of xpoints with random fibre costs. Its size is
+// the closest square to n.
+unsigned int build_fibres(Datastructures& ds, unsigned int n)
+{
+    auto side = static_cast<int>(std::sqrt(static_cast<double>(n)));
+    for (int y = 0; y < side; ++y) {
+        for (int x = 0; x < side; ++x) {
+            if (x + 1 < side) {
+                ds.add_fibre({x, y}, {x + 1, y}, random_in_range(1, 100));
+            }
+            if (y + 1 < side) {
+                ds.add_fibre({x, y}, {x, y + 1}, random_in_range(1, 100));
+            }
+        }
+    }
+    return static_cast<unsigned int>(side);
+}
+
+Coord random_grid_coord(unsigned int side)
+{
+    return {random_in_range(0, static_cast<int>(side) - 1), random_in_range(0, static_cast<int>(side) - 1)};
+}
+
+// Dependent random reads in a buffer of the given size, the growth that the
+// memory hierarchy alone causes. Each call reads as many cache lines as a
+// lookup of a beacon by id does.
+void bench_reference(unsigned int n, std::size_t bytes)
+{
+    struct Line
+    {
+        std::size_t next;
+        char padding[64 - sizeof(std::size_t)];
+    };
+    std::size_t lines = std::max<std::size_t>(bytes / sizeof(Line), 2);
+    // Sattolo's shuffle links the lines into one cycle in random order
+    std::vector<Line> buffer(lines);
+    for (std::size_t i = 0; i < lines; ++i) {
+        buffer[i].next = i;
+    }
+    for (std::size_t i = lines - 1; i > 0; --i) {
+        std::swap(buffer[i].next, buffer[random_in_range<std::size_t>(0, i - 1)].next);
+    }
+    std::size_t at = 0;
+    measure(REFERENCE_OP, n, MAX_REPS, [&](unsigned int) {
+        for (unsigned int read = 0; read < REFERENCE_READS; ++read) {
+            at = buffer[at].next;
+        }
+    });
+    reference_sink = at;
+}
+
+void bench_beacons(unsigned int n)
+{
+    Datastructures ds;
+    build_beacons(ds, n);
+    bench_reference(n, ds.memory_usage().at("total"));
+    auto random_id = [n](unsigned int) { return beacon_id(random_in_range(0u, n - 1)); };
+
+    measure("beacon_count", n, MAX_REPS, [&](unsigned int) { ds.beacon_count(); });
+    measure("all_beacons", n, MAX_REPS, [&](unsigned int) { ds.all_beacons(); });
+    measure("get_name", n, MAX_REPS, [&](unsigned int i) { ds.get_name(random_id(i)); });
+    measure("get_coordinates", n, MAX_REPS, [&](unsigned int i) { ds.get_coordinates(random_id(i)); });
+    measure("get_color", n, MAX_REPS, [&](unsigned int i) { ds.get_color(random_id(i)); });
+    measure("beacons_alphabetically", n, MAX_REPS, [&](unsigned int) { ds.beacons_alphabetically(); });
+    measure("beacons_brightness_increasing", n, MAX_REPS, [&](unsigned int) { ds.beacons_brightness_increasing(); });
+    measure("min_brightness", n, MAX_REPS, [&](unsigned int) { ds.min_brightness(); });
+    measure("max_brightness", n, MAX_REPS, [&](unsigned int) { ds.max_brightness(); });
+    measure("find_beacons", n, MAX_REPS, [&](unsigned int) { ds.find_beacons(random_name()); });
+    measure("get_lightsources", n, MAX_REPS, [&](unsigned int i) { ds.get_lightsources(random_id(i)); });
+    measure("path_outbeam", n, MAX_REPS, [&](unsigned int i) { ds.path_outbeam(random_id(i)); });
+    measure("get_all_lightsources", n, MAX_REPS, [&](unsigned int i) { ds.get_all_lightsources(random_id(i)); });
+    measure("count_all_lightsources", n, MAX_REPS, [&](unsigned int i) { ds.count_all_lightsources(random_id(i)); });
+    measure("is_upstream", n, MAX_REPS, [&](unsigned int i) { ds.is_upstream(random_id(i), random_id(i)); });
+    measure("path_inbeam_longest", n, MAX_REPS, [&](unsigned int) { ds.path_inbeam_longest(beacon_id(0)); });
+    measure("total_color", n, MAX_REPS, [&](unsigned int) { ds.total_color(beacon_id(0)); });
+    measure("find_beacons_by_color", n, MAX_REPS, [&](unsigned int) { ds.find_beacons_by_color(random_color(), 10); });
+    measure("nearest_color", n, MAX_REPS, [&](unsigned int) { ds.nearest_color(random_color(), 10); });
+    measure("brightness_histogram", n, MAX_REPS, [&](unsigned int) { ds.brightness_histogram(64); });
+    measure("memory_usage", n, MAX_REPS, [&](unsigned int) { ds.memory_usage(); });
+    measure("change_beacon_name", n, MAX_REPS, [&](unsigned int i) { ds.change_beacon_name(random_id(i), random_name()); });
+    measure("change_beacon_color", n, MAX_REPS, [&](unsigned int i) { ds.change_beacon_color(random_id(i), random_color()); });
+    unsigned int added = 0;
+    measure("add_beacon", n, MAX_REPS, [&](unsigned int i) {
+        ds.add_beacon("N" + std::to_string(i), random_name(), random_coord(), random_color());
+        added = i + 1;
+    });
+    // The new beacons have no lightbeams yet, so every call links one
+    measure("add_lightbeam", n, added, [&](unsigned int i) {
+        ds.add_lightbeam("N" + std::to_string(i), random_id(i));
+    });
+    // A burst of renames and recolors, buffered and applied in one commit
+    measure("commit", n, 1, [&](unsigned int) {
+        ds.begin_batch();
+        for (unsigned int i = 0; i < COMMIT_CHANGES / 2; ++i) {
+            ds.change_beacon_name(random_id(i), random_name());
+            ds.change_beacon_color(random_id(i), random_color());
+        }
+        ds.commit();
+    });
+    // Removals take beacons from the end so that every call removes something
+    measure("remove_beacon", n, n / 2, [&](unsigned int i) { ds.remove_beacon(beacon_id(n - 1 - i)); });
+    // Every publish follows a change, whose first write to each page after
+    // the previous publish copies the page. Measured last, as any change
+    // after a publish pays for such copies.
+    measure("publish", n, MAX_REPS, [&](unsigned int i) {
+        ds.change_beacon_color(beacon_id(i % (n / 2)), random_color());
+        ds.publish();
+    });
+    measure("snapshot", n, MAX_REPS, [&](unsigned int) { ds.snapshot(); });
+    measure("clear_beacons", n, 1, [&](unsigned int) { ds.clear_beacons(); });
+}
+
+void bench_fibres(unsigned int n)
+{
+    Datastructures ds;
+    auto side = build_fibres(ds, n);
+    auto random_xpoint = [side](unsigned int) { return random_grid_coord(side); };
+
+    measure("all_xpoints", n, MAX_REPS, [&](unsigned int) { ds.all_xpoints(); });
+    measure("get_fibres_from", n, MAX_REPS, [&](unsigned int i) { ds.get_fibres_from(random_xpoint(i)); });
+    measure("all_fibres", n, MAX_REPS, [&](unsigned int) { ds.all_fibres(); });
+    measure("nearest_xpoint", n, MAX_REPS, [&](unsigned int i) { ds.nearest_xpoint(random_xpoint(i)); });
+    measure("nearest_xpoints", n, MAX_REPS, [&](unsigned int i) { ds.nearest_xpoints(random_xpoint(i), 10); });
+    measure("xpoints_in_rectangle", n, MAX_REPS, [&](unsigned int i) {
+        Coord xy = random_xpoint(i);
+        ds.xpoints_in_rectangle(xy, {xy.x + 10, xy.y + 10});
+    });
+    measure("fibres_in_rectangle", n, MAX_REPS, [&](unsigned int i) {
+        Coord xy = random_xpoint(i);
+        ds.fibres_in_rectangle(xy, {xy.x + 10, xy.y + 10});
+    });
+    measure("fibres_crossing", n, MAX_REPS, [&](unsigned int i) {
+        Coord xy = random_xpoint(i);
+        ds.fibres_crossing(xy, {xy.x + 10, xy.y + 7});
+    });
+    measure("route_any", n, MAX_REPS, [&](unsigned int i) { ds.route_any(random_xpoint(i), random_xpoint(i)); });
+    measure("route_least_xpoints", n, MAX_REPS, [&](unsigned int i) {
+        ds.route_least_xpoints(random_xpoint(i), random_xpoint(i));
+    });
+    measure("route_fastest", n, MAX_REPS, [&](unsigned int i) { ds.route_fastest(random_xpoint(i), random_xpoint(i)); });
+    measure("route_k_fastest", n, 1, [&](unsigned int) {
+        Coord xy = random_grid_coord(side - NEAR);
+        ds.route_k_fastest(xy, {xy.x + random_in_range(0, NEAR), xy.y + random_in_range(0, NEAR)}, 3);
+    });
+    measure("routes_within_cost", n, MAX_REPS, [&](unsigned int) {
+        Coord xy = random_grid_coord(side - 1);
+        ds.routes_within_cost(xy, {xy.x + 1, xy.y + 1}, 150);
+    });
+    measure("begin_route_search", n, MAX_REPS, [&](unsigned int i) {
+        ds.begin_route_search(random_xpoint(i), random_xpoint(i), FASTEST_ROUTE);
+    });
+    measure("route_fibre_cycle", n, MAX_REPS, [&](unsigned int i) { ds.route_fibre_cycle(random_xpoint(i)); });
+    measure("trim_fibre_network", n, MAX_REPS, [&](unsigned int) { ds.trim_fibre_network(); });
+    // The hubs are in one corner of the grid
+    measure("add_hub", n, HUBS, [&](unsigned int i) { ds.add_hub({static_cast<int>(i), static_cast<int>(i)}); });
+    measure("all_hubs", n, MAX_REPS, [&](unsigned int) { ds.all_hubs(); });
+    auto hubs = ds.all_hubs();
+    // Cost changes on the fibres going right in the opposite corner, the hub
+    // trees follow them
+    measure("update_fibre_cost", n, MAX_REPS, [&](unsigned int) {
+        Coord xy = {static_cast<int>(side) - 2 - random_in_range(0, NEAR), static_cast<int>(side) - 1 - random_in_range(0, NEAR)};
+        ds.update_fibre_cost(xy, {xy.x + 1, xy.y}, random_in_range(1, 100));
+    });
+    measure("route_from_hub", n, MAX_REPS, [&](unsigned int i) {
+        Coord hub = hubs.at(i % hubs.size());
+        ds.route_from_hub(hub, {hub.x + random_in_range(0, NEAR), hub.y + random_in_range(0, NEAR)});
+    });
+    measure("remove_hub", n, static_cast<unsigned int>(hubs.size()), [&](unsigned int i) { ds.remove_hub(hubs.at(i)); });
+    // New fibres go outside the grid, removals cut the fibres going right
+    // from the first row
+    measure("add_fibre", n, MAX_REPS, [&](unsigned int i) {
+        ds.add_fibre({-1, static_cast<int>(i)}, {-2, static_cast<int>(i)}, random_in_range(1, 100));
+    });
+    measure("remove_fibre", n, side - 1, [&](unsigned int i) {
+        ds.remove_fibre({static_cast<int>(i), 0}, {static_cast<int>(i) + 1, 0});
+    });
+    measure("clear_fibres", n, 1, [&](unsigned int) { ds.clear_fibres(); });
+}
+
+// Generates a command file with n beacons, n lightbeams and n fibres and
+// measures how fast it is ingested.
+void bench_ingest(unsigned int n)
+{
+    std::ostringstream commands;
+    for (unsigned int i = 0; i < n; ++i) {
+        auto xy = random_coord();
+        auto color = random_color();
+        commands << "add_beacon " << beacon_id(i) << " \"" << random_name() << "\" ("
+                 << xy.x << "," << xy.y << ") (" << color.r << "," << color.g << "," << color.b << ")\n";
+    }
+    for (unsigned int i = 1; i < n; ++i) {
+        commands << "add_lightbeam " << beacon_id(i) << " " << beacon_id(random_in_range(0u, i - 1)) << "\n";
+    }
+    for (unsigned int i = 0; i < n; ++i) {
+        auto xy1 = random_coord();
+        auto xy2 = random_coord();
+        commands << "add_fibre (" << xy1.x << "," << xy1.y << ") (" << xy2.x << "," << xy2.y << ") "
+                 << random_in_range(1, 100) << "\n";
+    }
+    auto text = commands.str();
+
+    measure("ingest_stream", n, 1, [&](unsigned int) {
+        Datastructures ds;
+        std::istringstream input(text);
+        ds.ingest_stream(input);
+    }, text.size());
+}
+
+double median(std::vector<double> values)
+{
+    if (values.empty()) {
+        return 0.0;
+    }
+    auto middle = values.begin() + static_cast<std::ptrdiff_t>(values.size() / 2);
+    std::nth_element(values.begin(), middle, values.end());
+    if (values.size() % 2 == 1) {
+        return *middle;
+    }
+    return (*middle + *std::max_element(values.begin(), middle)) / 2;
+}
+
+// The sample with the median ns/op of each operation and size, in the order
+// the operations were first measured
+std::vector<Sample> median_samples(std::vector<Sample> const& all_samples)
+{
+    std::vector<Sample> medians;
+    std::map<std::pair<std::string, unsigned int>, std::vector<Sample>> repeats;
+    for (const auto& sample : all_samples) {
+        auto& same = repeats[{sample.op, sample.n}];
+        if (same.empty()) {
+            medians.push_back(sample);
+        }
+        same.push_back(sample);
+    }
+    for (auto& sample : medians) {
+        auto& same = repeats.at({sample.op, sample.n});
+        std::sort(same.begin(), same.end(),
+                  [](Sample const& lhs, Sample const& rhs) { return lhs.ns_per_op < rhs.ns_per_op; });
+        sample = same.at(same.size() / 2);
+    }
+    return medians;
+}
+
+// Median of the slopes of log(ns/op) against log(n) between all pairs of the
+// sizes within a factor of ten of the largest
+double fit_exponent(std::vector<Sample> op_samples)
+{
+    unsigned int max_n = 0;
+    for (const auto& sample : op_samples) {
+        max_n = std::max(max_n, sample.n);
+    }
+    op_samples.erase(std::remove_if(op_samples.begin(), op_samples.end(),
+                                    [max_n](Sample const& sample) { return sample.n * 10ull < max_n; }),
+                     op_samples.end());
+    std::vector<double> slopes;
+    for (std::size_t i = 0; i < op_samples.size(); ++i) {
+        for (std::size_t j = i + 1; j < op_samples.size(); ++j) {
+            double dx = std::log(static_cast<double>(op_samples.at(j).n))
+                    - std::log(static_cast<double>(op_samples.at(i).n));
+            double dy = std::log(std::max(op_samples.at(j).ns_per_op, 1.0))
+                    - std::log(std::max(op_samples.at(i).ns_per_op, 1.0));
+            if (dx != 0) {
+                slopes.push_back(dy / dx);
+            }
+        }
+    }
+    return median(slopes);
+}
+
+// Fitted exponents of the operations in the output of perftest --json
+std::map<std::string, double> read_baseline(std::string const& filename)
+{
+    std::ifstream input(filename);
+    if (!input) {
+        throw std::runtime_error("cannot open baseline " + filename);
+    }
+    std::string const op_key = "\"op\": \"";
+    std::string const exponent_key = "\"fitted_exponent\": ";
+    std::map<std::string, double> exponents;
+    std::string line;
+    while (std::getline(input, line)) {
+        auto op = line.find(op_key);
+        auto exponent = line.find(exponent_key);
+        if (op == std::string::npos or exponent == std::string::npos) {
+            continue;
+        }
+        op += op_key.size();
+        exponents[line.substr(op, line.find('"', op) - op)] = std::stod(line.substr(exponent + exponent_key.size()));
+    }
+    return exponents;
+}
+
+// The sizes measured: 1000, 2000, 5000, 10000, ... up to max_size
+std::vector<unsigned int> sizes_up_to(unsigned int max_size)
+{
+    std::vector<unsigned int> sizes;
+    for (unsigned int decade = 1000; decade <= max_size; decade *= 10) {
+        for (unsigned int step : {1u, 2u, 5u}) {
+            if (decade * step <= max_size) {
+                sizes.push_back(decade * step);
+            }
+        }
+    }
+    return sizes;
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+    unsigned int max_size = 1000000;
+    unsigned int repeats = DEFAULT_REPEATS;
+    std::map<std::string, double> baseline;
+    std::string header = default_header();
+    bool json = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--json") {
+            json = true;
+        } else if (arg == "--baseline" and i + 1 < argc) {
+            try {
+                baseline = read_baseline(argv[++i]);
+            } catch (std::exception const& error) {
+                std::cerr << error.what() << std::endl;
+                return EXIT_FAILURE;
+            }
+        } else if (arg == "--header" and i + 1 < argc) {
+            header = argv[++i];
+        } else if (arg == "--repeats" and i + 1 < argc) {
+            repeats = static_cast<unsigned int>(std::stoul(argv[++i]));
+            if (repeats == 0) {
+                std::cerr << "repeats must be at least 1" << std::endl;
+                return EXIT_FAILURE;
+            }
+        } else {
+            max_size = static_cast<unsigned int>(std::stoul(arg));
+            if (max_size < 1000 or max_size > 10000000) {
+                std::cerr << "max_size must be between 1000 and 10000000" << std::endl;
+                return EXIT_FAILURE;
+            }
+        }
+    }
+    std::map<std::string, Declared> declared;
+    try {
+        declared = read_declared(header);
+    } catch (std::exception const& error) {
+        std::cerr << error.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    for (unsigned int n : sizes_up_to(max_size)) {
+        if (!json) {
+            std::cerr << "Measuring n = " << n << "..." << std::endl;
+        }
+        for (unsigned int repeat = 0; repeat < repeats; ++repeat) {
+            bench_beacons(n);
+            bench_fibres(n);
+            bench_ingest(n);
+        }
+    }
+    samples = median_samples(samples);
+
+    std::map<std::string, std::vector<Sample>> by_op;
+    for (const auto& sample : samples) {
+        by_op[sample.op].push_back(sample);
+    }
+    double reference_exponent = fit_exponent(by_op.at(REFERENCE_OP));
+    by_op.erase(REFERENCE_OP);
+    auto declared_of = [&](std::string const& op) {
+        auto found = declared.find(op);
+        return found != declared.end() ? found->second : Declared{"Not declared", 0.0, false};
+    };
+    auto exceeds_declared = [&](std::string const& op, double exponent) {
+        auto const& op_declared = declared_of(op);
+        if (!op_declared.has_exponent) {
+            return false;
+        }
+        double slack = op_declared.exponent < 1.0 ? std::min(std::max(reference_exponent, 0.0), MAX_REFERENCE_SLACK) : 0.0;
+        return exponent > op_declared.exponent + slack + EXPONENT_TOLERANCE;
+    };
+    auto grew = [&](std::string const& op, double exponent) {
+        auto before = baseline.find(op);
+        return before != baseline.end() and exponent > before->second + EXPONENT_TOLERANCE;
+    };
+
+    if (json) {
+        std::cout << "{\n  \"samples\": [\n";
+        for (std::size_t i = 0; i < samples.size(); ++i) {
+            const auto& sample = samples.at(i);
+            std::cout << "    {\"op\": \"" << sample.op << "\", \"n\": " << sample.n
+                      << ", \"ns_per_op\": " << sample.ns_per_op
+                      << ", \"allocs_per_op\": " << sample.allocs_per_op;
+            if (sample.gb_per_s > 0) {
+                std::cout << ", \"gb_per_s\": " << sample.gb_per_s;
+            }
+            std::cout << "}" << (i + 1 < samples.size() ? "," : "") << "\n";
+        }
+        std::cout << "  ],\n  \"reference_exponent\": " << reference_exponent << ",\n  \"operations\": [\n";
+        std::size_t i = 0;
+        for (const auto& op : by_op) {
+            auto op_declared = declared_of(op.first);
+            double exponent = fit_exponent(op.second);
+            std::cout << "    {\"op\": \"" << op.first << "\", \"declared\": \"" << op_declared.complexity << "\"";
+            if (op_declared.has_exponent) {
+                std::cout << ", \"declared_exponent\": " << op_declared.exponent;
+            }
+            std::cout << ", \"fitted_exponent\": " << exponent
+                      << ", \"flagged\": " << (exceeds_declared(op.first, exponent) ? "true" : "false")
+                      << ", \"regressed\": " << (grew(op.first, exponent) ? "true" : "false") << "}"
+                      << (++i < by_op.size() ? "," : "") << "\n";
+        }
+        std::cout << "  ]\n}" << std::endl;
+        return EXIT_SUCCESS;
+    }
+
+    std::cout << std::left << std::setw(32) << "operation" << std::right << std::setw(10) << "n"
+              << std::setw(14) << "ns/op" << std::setw(14) << "allocs/op" << std::endl;
+    for (const auto& sample : samples) {
+        std::cout << std::left << std::setw(32) << sample.op << std::right << std::setw(10) << sample.n
+                  << std::setw(14) << std::fixed << std::setprecision(1) << sample.ns_per_op
+                  << std::setw(14) << sample.allocs_per_op;
+        if (sample.gb_per_s > 0) {
+            std::cout << std::setprecision(3) << "  " << sample.gb_per_s << " GB/s";
+        }
+        std::cout << std::endl;
+    }
+    std::cout << std::endl << "Growth of " << REFERENCE_OP << ": " << std::setprecision(2) << reference_exponent
+              << ", allowed on top of the declared exponent of sublinear operations, up to "
+              << MAX_REFERENCE_SLACK << std::endl;
+    std::cout << std::endl << std::left << std::setw(32) << "operation" << std::setw(18) << "declared"
+              << std::right << std::setw(10) << "fitted" << std::endl;
+    for (const auto& op : by_op) {
+        auto op_declared = declared_of(op.first);
+        double exponent = fit_exponent(op.second);
+        std::cout << std::left << std::setw(32) << op.first << std::setw(18) << op_declared.complexity
+                  << std::right << std::setw(10) << std::setprecision(2) << exponent
+                  << (exceeds_declared(op.first, exponent) ? "  EXCEEDS DECLARED" : "")
+                  << (grew(op.first, exponent) ? "  GREW SINCE BASELINE" : "") << std::endl;
+    }
+    return EXIT_SUCCESS;
+}
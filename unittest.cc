@@ -0,0 +1,1177 @@
+// Unittest.cc
+//
+// Correctness tests for Datastructures. Each test builds random beacons or
+// fibres, and checks the operations against a plain computation of the same
+// answer, or against the same query on the live object.
+//
+// Usage: unittest
+//   Prints every failed check and exits with a nonzero status if there were any.
+
+#include "datastructures.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <numeric>
+#include <sstream>
+#include <thread>
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            ++failures; \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #condition << std::endl; \
+        } \
+    } while (false)
+
+BeaconID beacon_id(unsigned int i)
+{
+    return "B" + std::to_string(i);
+}
+
+// Names from a small alphabet, so that many beacons share a name
+std::string random_name()
+{
+    std::string name;
+    auto length = random_in_range(1, 3);
+    for (int i = 0; i < length; ++i) {
+        name += random_in_range('a', 'c');
+    }
+    return name;
+}
+
+Color random_color()
+{
+    return {random_in_range(0, 255), random_in_range(0, 255), random_in_range(0, 255)};
+}
+
+Coord random_coord()
+{
+    return {random_in_range(-1000, 1000), random_in_range(-1000, 1000)};
+}
+
+// Adds n beacons in a random forest, then removes every tenth and changes
+// the name and color of some, so that rows are reused and reordered
+void build_beacons(Datastructures& ds, unsigned int n)
+{
+    for (unsigned int i = 0; i < n; ++i) {
+        ds.add_beacon(beacon_id(i), random_name(), random_coord(), random_color());
+    }
+    for (unsigned int i = 1; i < n; ++i) {
+        if (random_in_range(0, 9) != 0) {
+            ds.add_lightbeam(beacon_id(i), beacon_id(random_in_range(0u, i - 1)));
+        }
+    }
+    for (unsigned int i = 0; i < n; i += 10) {
+        ds.remove_beacon(beacon_id(i));
+    }
+    for (unsigned int i = 0; i < n / 5; ++i) {
+        auto id = beacon_id(random_in_range(0u, n - 1));
+        ds.change_beacon_name(id, random_name());
+        ds.change_beacon_color(id, random_color());
+    }
+    for (unsigned int i = n; i < n + n / 10; ++i) {
+        ds.add_beacon(beacon_id(i), random_name(), random_coord(), random_color());
+    }
+}
+
+// Adds a side x side grid of xpoints with random fibre costs
+void build_grid(Datastructures& ds, int side)
+{
+    for (int y = 0; y < side; ++y) {
+        for (int x = 0; x < side; ++x) {
+            if (x + 1 < side) {
+                ds.add_fibre({x, y}, {x + 1, y}, random_in_range(1, 100));
+            }
+            if (y + 1 < side) {
+                ds.add_fibre({x, y}, {x, y + 1}, random_in_range(1, 100));
+            }
+        }
+    }
+}
+
+// Everything a snapshot answers about the beacons, for comparing two states
+struct BeaconAnswers
+{
+    int count;
+    std::vector<BeaconID> all;
+    std::vector<BeaconID> alphabetically;
+    std::vector<BeaconID> brightness_increasing;
+    BeaconID min;
+    BeaconID max;
+    std::vector<std::vector<BeaconID>> found;
+    std::vector<std::string> names;
+    std::vector<std::vector<BeaconID>> sources;
+    std::vector<std::vector<BeaconID>> longest;
+    std::vector<Color> totals;
+    std::vector<BeaconID> by_color;
+    std::vector<BeaconID> nearest;
+    std::vector<int> histogram;
+};
+
+bool operator==(BeaconAnswers const& lhs, BeaconAnswers const& rhs)
+{
+    auto same_colors = std::equal(lhs.totals.begin(), lhs.totals.end(), rhs.totals.begin(), rhs.totals.end());
+    return lhs.count == rhs.count and lhs.all == rhs.all and lhs.alphabetically == rhs.alphabetically
+            and lhs.brightness_increasing == rhs.brightness_increasing and lhs.min == rhs.min
+            and lhs.max == rhs.max and lhs.found == rhs.found and lhs.names == rhs.names
+            and lhs.sources == rhs.sources and lhs.longest == rhs.longest and same_colors
+            and lhs.by_color == rhs.by_color and lhs.nearest == rhs.nearest and lhs.histogram == rhs.histogram;
+}
+
+// Source is either a Datastructures or a Snapshot
+template <typename Source>
+BeaconAnswers beacon_answers(Source& source, unsigned int ids)
+{
+    BeaconAnswers answers;
+    answers.count = source.beacon_count();
+    answers.all = source.all_beacons();
+    std::sort(answers.all.begin(), answers.all.end());
+    answers.alphabetically = source.beacons_alphabetically();
+    answers.brightness_increasing = source.beacons_brightness_increasing();
+    answers.min = source.min_brightness();
+    answers.max = source.max_brightness();
+    for (std::string name : {"a", "b", "ab", "cc", "abc", "x"}) {
+        answers.found.push_back(source.find_beacons(name));
+    }
+    for (unsigned int i = 0; i < ids; i += 7) {
+        answers.names.push_back(source.get_name(beacon_id(i)));
+        answers.sources.push_back(source.get_all_lightsources(beacon_id(i)));
+        answers.longest.push_back(source.path_inbeam_longest(beacon_id(i)));
+        answers.totals.push_back(source.total_color(beacon_id(i)));
+    }
+    answers.by_color = source.find_beacons_by_color({100, 100, 100}, 80);
+    answers.nearest = source.nearest_color({10, 200, 30}, 20);
+    answers.histogram = source.brightness_histogram(16);
+    return answers;
+}
+
+// Checks the ordered queries against a sort of all beacons
+void check_orders(Datastructures& ds)
+{
+    auto ids = ds.all_beacons();
+    auto alphabetically = ds.beacons_alphabetically();
+    CHECK(alphabetically.size() == ids.size());
+    CHECK(std::is_permutation(alphabetically.begin(), alphabetically.end(), ids.begin(), ids.end()));
+    CHECK(std::is_sorted(alphabetically.begin(), alphabetically.end(), [&](BeaconID const& lhs, BeaconID const& rhs) {
+        return ds.get_name(lhs) < ds.get_name(rhs);
+    }));
+
+    auto brightness = [&](BeaconID const& id) {
+        Color color = ds.get_color(id);
+        return 3 * color.r + 6 * color.g + color.b;
+    };
+    auto increasing = ds.beacons_brightness_increasing();
+    CHECK(std::is_permutation(increasing.begin(), increasing.end(), ids.begin(), ids.end()));
+    CHECK(std::is_sorted(increasing.begin(), increasing.end(), [&](BeaconID const& lhs, BeaconID const& rhs) {
+        return brightness(lhs) < brightness(rhs);
+    }));
+    if (!increasing.empty()) {
+        CHECK(brightness(ds.min_brightness()) == brightness(increasing.front()));
+        CHECK(brightness(ds.max_brightness()) == brightness(increasing.back()));
+    }
+
+    for (std::string name : {"a", "b", "ab", "cc", "abc"}) {
+        std::vector<BeaconID> expected;
+        for (const auto& id : ids) {
+            if (ds.get_name(id) == name) {
+                expected.push_back(id);
+            }
+        }
+        std::sort(expected.begin(), expected.end());
+        CHECK(ds.find_beacons(name) == expected);
+    }
+}
+
+// ---------------------------- Snapshots -------------------------------------
+
+void test_snapshot_queries()
+{
+    Datastructures ds;
+    build_beacons(ds, 3000);
+    build_grid(ds, 20);
+    check_orders(ds);
+    ds.publish();
+    auto snapshot = ds.snapshot();
+    CHECK(beacon_answers(*snapshot, 3300) == beacon_answers(ds, 3300));
+    CHECK(snapshot->all_xpoints() == ds.all_xpoints());
+    CHECK(snapshot->all_fibres() == ds.all_fibres());
+    CHECK(snapshot->route_fastest({0, 0}, {19, 19}) == ds.route_fastest({0, 0}, {19, 19}));
+    CHECK(snapshot->route_fibre_cycle({3, 4}) == ds.route_fibre_cycle({3, 4}));
+    CHECK(snapshot->route_fibre_cycle({-1, -1}).empty());
+}
+
+void test_snapshot_isolation()
+{
+    Datastructures ds;
+    build_beacons(ds, 3000);
+    build_grid(ds, 20);
+    ds.publish();
+    auto snapshot = ds.snapshot();
+    auto before = beacon_answers(*snapshot, 3300);
+    auto xpoints_before = snapshot->all_xpoints();
+    auto fibres_before = snapshot->get_fibres_from({5, 5});
+    auto all_fibres_before = snapshot->all_fibres();
+    auto route_before = snapshot->route_fastest({0, 0}, {19, 19});
+
+    build_beacons(ds, 2000);
+    for (int i = 0; i < 200; ++i) {
+        ds.change_beacon_name(beacon_id(random_in_range(0u, 3299u)), random_name());
+        ds.change_beacon_color(beacon_id(random_in_range(0u, 3299u)), random_color());
+    }
+    ds.remove_fibre({5, 5}, {6, 5});
+    ds.update_fibre_cost({5, 5}, {5, 6}, 1000);
+    ds.add_fibre({5, 5}, {-7, -7}, 3);
+    for (int x = 0; x < 19; ++x) {
+        ds.update_fibre_cost({x, 0}, {x + 1, 0}, 500);
+    }
+    check_orders(ds);
+
+    // The old snapshot still answers from the state it was published in
+    CHECK(beacon_answers(*snapshot, 3300) == before);
+    CHECK(snapshot->all_xpoints() == xpoints_before);
+    CHECK(snapshot->get_fibres_from({5, 5}) == fibres_before);
+    CHECK(snapshot->all_fibres() == all_fibres_before);
+    CHECK(snapshot->route_fastest({0, 0}, {19, 19}) == route_before);
+
+    ds.publish();
+    auto latest = ds.snapshot();
+    CHECK(beacon_answers(*latest, 3300) == beacon_answers(ds, 3300));
+    CHECK(latest->get_fibres_from({5, 5}) == ds.get_fibres_from({5, 5}));
+    CHECK(latest->all_fibres() == ds.all_fibres());
+    CHECK(!(beacon_answers(*latest, 3300) == before));
+
+    ds.clear_beacons();
+    ds.clear_fibres();
+    CHECK(latest->beacon_count() > 0);
+    CHECK(!latest->all_xpoints().empty());
+}
+
+// Readers query their snapshots while the writer keeps changing and publishing
+void test_concurrent_readers()
+{
+    Datastructures ds;
+    build_beacons(ds, 2000);
+    build_grid(ds, 10);
+    ds.publish();
+    std::atomic<bool> done(false);
+    std::atomic<int> reader_failures(0);
+    auto reader = [&]() {
+        while (!done.load()) {
+            auto snapshot = ds.snapshot();
+            auto alphabetically = snapshot->beacons_alphabetically();
+            if (static_cast<int>(alphabetically.size()) != snapshot->beacon_count()
+                    or snapshot->beacons_brightness_increasing().size() != alphabetically.size()
+                    or snapshot->route_fastest({0, 0}, {9, 9}).empty()) {
+                ++reader_failures;
+            }
+        }
+    };
+    std::thread reader1(reader);
+    std::thread reader2(reader);
+    for (unsigned int i = 0; i < 300; ++i) {
+        ds.add_beacon(beacon_id(10000 + i), random_name(), random_coord(), random_color());
+        ds.change_beacon_name(beacon_id(random_in_range(0u, 1999u)), random_name());
+        ds.remove_beacon(beacon_id(random_in_range(0u, 1999u)));
+        ds.update_fibre_cost({0, 0}, {1, 0}, random_in_range(1, 100));
+        ds.publish();
+    }
+    done = true;
+    reader1.join();
+    reader2.join();
+    CHECK(reader_failures == 0);
+}
+
+// ---------------------------- Batched mutations -----------------------------
+
+// Rebuilding the orders from scratch in commit() gives the same orders as
+// moving each row
+void test_batch_orders()
+{
+    Datastructures ds;
+    build_beacons(ds, 2000);
+    ds.begin_batch();
+    for (unsigned int i = 1; i < 2000; i += 2) {
+        ds.change_beacon_name(beacon_id(i), random_name());
+        ds.change_beacon_color(beacon_id(i), random_color());
+    }
+    CHECK(ds.commit());
+    check_orders(ds);
+}
+
+// A beacon removed while its rename is buffered
+void test_batch_rename_then_remove()
+{
+    Datastructures ds;
+    ds.add_beacon("A", "a", {1, 1}, {10, 20, 30});
+    ds.add_beacon("B", "b", {2, 2}, {10, 20, 30});
+    ds.begin_batch();
+    CHECK(ds.change_beacon_name("A", "x"));
+    CHECK(!ds.remove_beacon("A"));
+    CHECK(!ds.commit());
+    CHECK(ds.get_name("A") == "a");
+    CHECK(ds.beacon_count() == 2);
+    check_orders(ds);
+
+    // The other modifying operations are rejected as well
+    ds.begin_batch();
+    CHECK(!ds.add_beacon("C", "c", {3, 3}, {1, 2, 3}));
+    CHECK(!ds.commit());
+    ds.begin_batch();
+    ds.clear_beacons();
+    CHECK(!ds.commit());
+    CHECK(ds.beacon_count() == 2);
+    ds.begin_batch();
+    std::istringstream input("add_beacon C \"c\" (3,3) (1,2,3)\n");
+    auto errors = ds.ingest_stream(input);
+    CHECK(errors.size() == 1 and errors.front().line == 0);
+    CHECK(!ds.commit());
+    CHECK(ds.beacon_count() == 2);
+
+    // Outside a batch the removal goes through
+    CHECK(ds.remove_beacon("A"));
+    CHECK(ds.beacon_count() == 1);
+}
+
+// A fibre added back after its removal is buffered
+void test_batch_remove_then_add_fibre()
+{
+    Datastructures ds;
+    ds.add_fibre({0, 0}, {1, 0}, 5);
+    ds.add_fibre({1, 0}, {2, 0}, 5);
+    ds.begin_batch();
+    CHECK(ds.remove_fibre({0, 0}, {1, 0}));
+    CHECK(!ds.add_fibre({0, 0}, {1, 0}, 7));
+    CHECK(!ds.commit());
+    std::vector<std::pair<Coord, Cost>> expected = {{{1, 0}, 5}};
+    CHECK(ds.get_fibres_from({0, 0}) == expected);
+    CHECK(ds.all_fibres().size() == 2);
+
+    ds.begin_batch();
+    CHECK(!ds.update_fibre_cost({0, 0}, {1, 0}, 9));
+    CHECK(!ds.commit());
+    ds.begin_batch();
+    ds.clear_fibres();
+    CHECK(!ds.commit());
+    CHECK(ds.get_fibres_from({0, 0}) == expected);
+
+    ds.begin_batch();
+    CHECK(ds.remove_fibre({0, 0}, {1, 0}));
+    CHECK(ds.commit());
+    CHECK(ds.get_fibres_from({0, 0}).empty());
+    CHECK(ds.all_fibres().size() == 1);
+}
+
+// A second begin_batch() does not discard the open batch, it makes the
+// commit fail
+void test_batch_begin_twice()
+{
+    Datastructures ds;
+    ds.add_beacon("A", "a", {1, 1}, {1, 2, 3});
+    ds.add_fibre({0, 0}, {1, 0}, 5);
+    ds.begin_batch();
+    CHECK(ds.change_beacon_name("A", "b"));
+    CHECK(ds.remove_fibre({0, 0}, {1, 0}));
+    ds.begin_batch();
+    CHECK(ds.change_beacon_color("A", {4, 5, 6}));
+    CHECK(!ds.commit());
+    CHECK(ds.get_name("A") == "a");
+    CHECK(ds.get_color("A") == Color({1, 2, 3}));
+    CHECK(ds.all_fibres().size() == 1);
+
+    // The failed commit closed the batch
+    CHECK(ds.add_beacon("B", "b", {2, 2}, {1, 2, 3}));
+    ds.begin_batch();
+    CHECK(ds.change_beacon_name("A", "c"));
+    CHECK(ds.commit());
+    CHECK(ds.get_name("A") == "c");
+}
+
+// ---------------------------- Color queries ---------------------------------
+
+std::int64_t squared_color_distance(Color lhs, Color rhs)
+{
+    std::int64_t dr = lhs.r - rhs.r;
+    std::int64_t dg = lhs.g - rhs.g;
+    std::int64_t db = lhs.b - rhs.b;
+    return dr * dr + dg * dg + db * db;
+}
+
+// Colors from a coarse palette, so that many beacons are equally near a target
+Color palette_color()
+{
+    return {random_in_range(0, 4) * 60, random_in_range(0, 4) * 60, random_in_range(0, 4) * 60};
+}
+
+// Compares the color queries with a scalar computation over get_color.
+// Removed beacons leave free rows inside the scanned pages, and the beacon
+// count is not a multiple of the vector width.
+void test_color_queries()
+{
+    Datastructures ds;
+    unsigned int const n = 1237;
+    for (unsigned int i = 0; i < n; ++i) {
+        ds.add_beacon(beacon_id(i), random_name(), random_coord(), i % 2 == 0 ? palette_color() : random_color());
+    }
+    // Exactly 5 and just over 5 away from {120, 60, 180}
+    ds.add_beacon("edge", "e", {0, 0}, {123, 64, 180});
+    ds.add_beacon("beyond", "e", {0, 0}, {123, 64, 181});
+
+    for (int round = 0; round < 2; ++round) {
+        for (unsigned int i = round; i < n; i += 7) {
+            ds.remove_beacon(beacon_id(i));
+        }
+        auto ids = ds.all_beacons();
+        CHECK(ids.size() == static_cast<std::size_t>(ds.beacon_count()));
+
+        auto found = ds.find_beacons_by_color({120, 60, 180}, 5);
+        CHECK(std::find(found.begin(), found.end(), "edge") != found.end());
+        CHECK(std::find(found.begin(), found.end(), "beyond") == found.end());
+
+        // Black is what a free row would unpack to without its marker bit
+        for (Color target : {Color{0, 0, 0}, Color{120, 60, 180}, Color{255, 255, 255}, palette_color(), random_color()}) {
+            auto by_distance = ids;
+            std::sort(by_distance.begin(), by_distance.end(), [&](BeaconID const& lhs, BeaconID const& rhs) {
+                return std::make_pair(squared_color_distance(ds.get_color(lhs), target), lhs)
+                        < std::make_pair(squared_color_distance(ds.get_color(rhs), target), rhs);
+            });
+            for (int max_distance : {0, 5, 60, 120, 500}) {
+                std::vector<BeaconID> expected;
+                std::copy_if(ids.begin(), ids.end(), std::back_inserter(expected), [&](BeaconID const& id) {
+                    return squared_color_distance(ds.get_color(id), target) <= max_distance * max_distance;
+                });
+                std::sort(expected.begin(), expected.end());
+                CHECK(ds.find_beacons_by_color(target, max_distance) == expected);
+            }
+            for (int k : {0, 1, 10, 100, static_cast<int>(2 * n)}) {
+                std::vector<BeaconID> expected(by_distance.begin(),
+                                               by_distance.begin() + std::min(by_distance.size(), static_cast<std::size_t>(k)));
+                CHECK(ds.nearest_color(target, k) == expected);
+            }
+        }
+
+        for (int buckets : {1, 7, 16, MAX_BRIGHTNESS + 1}) {
+            std::vector<int> expected(static_cast<std::size_t>(buckets), 0);
+            for (const auto& id : ids) {
+                Color color = ds.get_color(id);
+                auto brightness = 3 * color.r + 6 * color.g + color.b;
+                ++expected.at(static_cast<std::size_t>(static_cast<long long>(brightness) * buckets / (MAX_BRIGHTNESS + 1)));
+            }
+            auto histogram = ds.brightness_histogram(buckets);
+            CHECK(histogram == expected);
+            CHECK(std::accumulate(histogram.begin(), histogram.end(), 0) == ds.beacon_count());
+        }
+
+        // The next round reuses the free rows
+        for (unsigned int i = round; i < n; i += 7) {
+            ds.add_beacon(beacon_id(i), random_name(), random_coord(), palette_color());
+        }
+    }
+}
+
+// ---------------------------- Hub trees -------------------------------------
+
+// Negative costs are rejected everywhere a cost enters the network
+void test_negative_costs()
+{
+    Datastructures ds;
+    build_grid(ds, 5);
+    CHECK(ds.add_hub({0, 0}));
+    auto fibres_before = ds.get_fibres_from({0, 0});
+    CHECK(!ds.update_fibre_cost({0, 0}, {1, 0}, -1));
+    CHECK(ds.get_fibres_from({0, 0}) == fibres_before);
+    CHECK(!ds.add_fibre({0, 0}, {4, 4}, -3));
+    CHECK(!ds.add_fibre({10, 10}, {11, 10}, -3));
+    CHECK(ds.get_fibres_from({0, 0}) == fibres_before);
+    CHECK(ds.get_fibres_from({10, 10}).empty());
+    CHECK(ds.update_fibre_cost({0, 0}, {1, 0}, 0));
+    CHECK(ds.route_from_hub({0, 0}, {4, 4}) == ds.route_fastest({0, 0}, {4, 4}));
+
+    std::istringstream input("add_fibre (20,20) (21,20) -4\nadd_fibre (20,20) (21,20) 4\n");
+    auto errors = ds.ingest_stream(input);
+    CHECK(errors.size() == 1);
+    if (errors.size() == 1) {
+        CHECK(errors.front().line == 1);
+        CHECK(errors.front().message == "Fibre cost must not be negative: -4");
+    }
+    std::vector<std::pair<Coord, Cost>> expected = {{{21, 20}, 4}};
+    CHECK(ds.get_fibres_from({20, 20}) == expected);
+}
+
+// The hub trees repaired after each change give the same costs as a new search
+void test_hub_repairs()
+{
+    Datastructures ds;
+    int const side = 12;
+    build_grid(ds, side);
+    CHECK(ds.add_hub({0, 0}));
+    CHECK(ds.add_hub({5, 7}));
+    for (int i = 0; i < 300; ++i) {
+        Coord xy = {random_in_range(0, side - 2), random_in_range(0, side - 2)};
+        Coord neighbour = random_in_range(0, 1) == 0 ? Coord{xy.x + 1, xy.y} : Coord{xy.x, xy.y + 1};
+        if (random_in_range(0, 9) == 0) {
+            if (!ds.remove_fibre(xy, neighbour)) {
+                ds.add_fibre(xy, neighbour, random_in_range(0, 100));
+            }
+        } else {
+            ds.update_fibre_cost(xy, neighbour, random_in_range(0, 100));
+        }
+        Coord to = {random_in_range(0, side - 1), random_in_range(0, side - 1)};
+        for (Coord hub : {Coord{0, 0}, Coord{5, 7}}) {
+            // A hub that lost its last fibre is registered again once it has one
+            if (!ds.get_fibres_from(hub).empty()) {
+                ds.add_hub(hub);
+            }
+            auto from_hub = ds.route_from_hub(hub, to);
+            auto fastest = ds.route_fastest(hub, to);
+            CHECK(from_hub.empty() == fastest.empty());
+            if (!from_hub.empty() and !fastest.empty()) {
+                CHECK(from_hub.back().second == fastest.back().second);
+            }
+        }
+    }
+}
+
+// A hub is dropped with its xpoint, and does not come back with new fibres
+void test_hub_lifetime()
+{
+    Datastructures ds;
+    build_grid(ds, 3);
+    CHECK(ds.add_hub({0, 0}));
+    CHECK(ds.add_hub({1, 1}));
+    CHECK(ds.remove_fibre({0, 0}, {1, 0}));
+    CHECK(ds.all_hubs() == std::vector<Coord>({{0, 0}, {1, 1}}));
+    CHECK(ds.remove_fibre({0, 0}, {0, 1}));
+    CHECK(ds.all_hubs() == std::vector<Coord>({{1, 1}}));
+    CHECK(ds.route_from_hub({0, 0}, {0, 0}).empty());
+
+    CHECK(ds.add_fibre({0, 0}, {2, 2}, 1));
+    CHECK(ds.all_hubs() == std::vector<Coord>({{1, 1}}));
+    CHECK(ds.route_from_hub({0, 0}, {2, 2}).empty());
+    CHECK(!ds.remove_hub({0, 0}));
+    CHECK(ds.route_from_hub({1, 1}, {0, 0}) == ds.route_fastest({1, 1}, {0, 0}));
+
+    // The same through a batch
+    CHECK(ds.add_hub({0, 0}));
+    ds.begin_batch();
+    CHECK(ds.remove_fibre({0, 0}, {2, 2}));
+    CHECK(ds.all_hubs() == std::vector<Coord>({{0, 0}, {1, 1}}));
+    ds.commit();
+    CHECK(ds.all_hubs() == std::vector<Coord>({{1, 1}}));
+
+    ds.clear_fibres();
+    CHECK(ds.all_hubs().empty());
+    build_grid(ds, 3);
+    CHECK(ds.all_hubs().empty());
+    CHECK(ds.route_from_hub({1, 1}, {2, 2}).empty());
+}
+
+// ---------------------------- Lightsource index -----------------------------
+
+// Compares the transitive lightsource queries with upstream sets rebuilt by
+// walking path_outbeam from every beacon. Lightbeams are added and beacons
+// removed and added again at random, so the index is unlinked and its rows
+// reused between the comparisons.
+void test_lightsource_index()
+{
+    Datastructures ds;
+    unsigned int const n = 150;
+    for (unsigned int i = 0; i < n; ++i) {
+        ds.add_beacon(beacon_id(i), random_name(), random_coord(), random_color());
+    }
+    for (int round = 0; round < 12; ++round) {
+        for (int step = 0; step < 100; ++step) {
+            auto id = beacon_id(random_in_range(0u, n - 1));
+            switch (random_in_range(0, 9)) {
+            case 0:
+                if (!ds.remove_beacon(id)) {
+                    ds.add_beacon(id, random_name(), random_coord(), random_color());
+                }
+                break;
+            default:
+                ds.add_lightbeam(id, beacon_id(random_in_range(0u, n - 1)));
+                break;
+            }
+        }
+
+        std::vector<std::vector<BeaconID>> upstream(n);
+        std::vector<bool> alive(n, false);
+        for (unsigned int i = 0; i < n; ++i) {
+            auto path = ds.path_outbeam(beacon_id(i));
+            alive[i] = path != std::vector<BeaconID>({NO_ID});
+            if (!alive[i]) {
+                continue;
+            }
+            CHECK(path.front() == beacon_id(i));
+            for (auto target = std::next(path.begin()); target != path.end(); ++target) {
+                upstream.at(std::stoul(target->substr(1))).push_back(beacon_id(i));
+            }
+        }
+        for (unsigned int i = 0; i < n; ++i) {
+            auto id = beacon_id(i);
+            if (!alive[i]) {
+                CHECK(ds.get_all_lightsources(id) == std::vector<BeaconID>({NO_ID}));
+                CHECK(ds.count_all_lightsources(id) == NO_VALUE);
+                continue;
+            }
+            std::sort(upstream[i].begin(), upstream[i].end());
+            CHECK(ds.get_all_lightsources(id) == upstream[i]);
+            CHECK(ds.count_all_lightsources(id) == static_cast<int>(upstream[i].size()));
+            for (unsigned int j = 0; j < n; ++j) {
+                bool expected = std::binary_search(upstream[i].begin(), upstream[i].end(), beacon_id(j));
+                CHECK(ds.is_upstream(beacon_id(j), id) == expected);
+            }
+        }
+    }
+}
+
+// ---------------------------- Bulk loading ----------------------------------
+
+// Each way a lightbeam can be rejected has its own message
+void test_ingest_lightbeam_errors()
+{
+    Datastructures ds;
+    std::istringstream input(
+            "add_beacon A \"a\" (1,1) (1,2,3)\n"
+            "add_beacon B \"b\" (2,2) (1,2,3)\n"
+            "add_beacon C \"c\" (3,3) (1,2,3)\n"
+            "add_lightbeam A B\n"
+            "add_lightbeam B C\n"
+            "add_lightbeam X A\n"
+            "add_lightbeam A Y\n"
+            "add_lightbeam A C\n"
+            "add_lightbeam C C\n"
+            "add_lightbeam C A\n");
+    auto errors = ds.ingest_stream(input);
+    std::vector<std::pair<int, std::string>> expected = {
+        {6, "Unknown beacon ID: X"},
+        {7, "Unknown beacon ID: Y"},
+        {8, "Beacon already has a lightbeam: A"},
+        {9, "Lightbeam from beacon to itself: C"},
+        {10, "Lightbeam would close a loop: C A"},
+    };
+    CHECK(errors.size() == expected.size());
+    for (std::size_t i = 0; i < std::min(errors.size(), expected.size()); ++i) {
+        CHECK(errors.at(i).line == expected.at(i).first);
+        CHECK(errors.at(i).message == expected.at(i).second);
+    }
+    CHECK(ds.path_outbeam("A") == std::vector<BeaconID>({"A", "B", "C"}));
+}
+
+// Errors of every kind, spread over an input of several chunks so that
+// their line numbers are counted across chunks and across the parts each
+// chunk is parsed in. One line is longer than a chunk, and long comments
+// between the beacons make up the rest.
+void test_ingest_errors()
+{
+    std::string text;
+    std::vector<std::pair<int, std::string>> expected;
+    int beacons = 0;
+    for (int line = 1; line <= 16000; ++line) {
+        if (line % 2 == 0 and line % 1000 != 0) {
+            text += "# " + std::string(300, '-') + "\n";
+            continue;
+        }
+        auto id = beacon_id(static_cast<unsigned int>(line));
+        switch (line % 1000 == 0 ? line / 1000 % 7 : -1) {
+        case 0:
+            text += "add_beacon " + id + " \"a\" (1,1)\n";
+            expected.push_back({line, "Malformed add_beacon command"});
+            break;
+        case 1:
+            text += "remove_beacon " + id + "\n";
+            expected.push_back({line, "Unknown command: remove_beacon"});
+            break;
+        case 2:
+            text += "add_beacon " + beacon_id(static_cast<unsigned int>(line - 1)) + " \"b\" (1,1) (1,2,3)\n";
+            expected.push_back({line, "Beacon ID already exists: " + beacon_id(static_cast<unsigned int>(line - 1))});
+            break;
+        case 3:
+            text += "add_beacon " + id + " \"b\" (1,1) (1,2,300)\n";
+            expected.push_back({line, "Color channels must be 0..255: " + id});
+            break;
+        case 4:
+            text += "add_beacon " + id + " \"" + std::string(MAX_LINE_LENGTH, 'a') + "\" (1,1) (1,2,3)\n";
+            expected.push_back({line, "Line is longer than " + std::to_string(MAX_LINE_LENGTH) + " characters"});
+            break;
+        case 5:
+            text += line == 5000 ? std::string(5 * 1024 * 1024, 'x') + "\n" : "# comment\n";
+            if (line == 5000) {
+                expected.push_back({line, "Line is longer than " + std::to_string(MAX_LINE_LENGTH) + " characters"});
+            }
+            break;
+        case 6:
+            text += "add_lightbeam " + id + " " + beacon_id(static_cast<unsigned int>(line - 1)) + "\n";
+            expected.push_back({line, "Unknown beacon ID: " + id});
+            break;
+        default:
+            auto color = random_color();
+            text += "add_beacon " + id + " \"" + random_name() + "\" (" + std::to_string(line) + ",0) ("
+                    + std::to_string(color.r) + "," + std::to_string(color.g) + "," + std::to_string(color.b) + ")\n";
+            ++beacons;
+            break;
+        }
+    }
+
+    Datastructures ds;
+    std::istringstream input(text);
+    auto errors = ds.ingest_stream(input);
+    CHECK(errors.size() == expected.size());
+    for (std::size_t i = 0; i < std::min(errors.size(), expected.size()); ++i) {
+        CHECK(errors.at(i).line == expected.at(i).first);
+        CHECK(errors.at(i).message == expected.at(i).second);
+    }
+    CHECK(ds.beacon_count() == beacons);
+    CHECK(ds.get_coordinates(beacon_id(1999)) == Coord({1999, 0}));
+    check_orders(ds);
+
+    // Into a store that is not empty, beacons are inserted one by one
+    std::istringstream more("add_beacon B1 \"a\" (1,1) (1,2,3)\nadd_beacon N1 \"ab\" (1,1) (0,0,0)\n"
+                            "add_lightbeam N1 B1\n");
+    errors = ds.ingest_stream(more);
+    CHECK(errors.size() == 1 and errors.at(0).line == 1);
+    CHECK(ds.beacon_count() == beacons + 1);
+    CHECK(ds.get_lightsources("B1") == std::vector<BeaconID>({"N1"}));
+    check_orders(ds);
+}
+
+// ---------------------------- Alternative routes ----------------------------
+
+using Route = std::vector<std::pair<Coord, Cost>>;
+
+// Every loopless route from the last xpoint of route to to, by depth-first
+// enumeration
+void all_routes(Datastructures& ds, Route& route, Coord to, std::vector<Route>& routes)
+{
+    auto [xy, cost] = route.back();
+    if (xy == to) {
+        routes.push_back(route);
+        return;
+    }
+    for (const auto& fibre : ds.get_fibres_from(xy)) {
+        auto visited = std::find_if(route.begin(), route.end(), [&](auto& step) { return step.first == fibre.first; });
+        if (visited == route.end()) {
+            route.push_back({fibre.first, cost + fibre.second});
+            all_routes(ds, route, to, routes);
+            route.pop_back();
+        }
+    }
+}
+
+// True if route is loopless, follows existing fibres and adds up their costs
+bool valid_route(Datastructures& ds, Route const& route, Coord from, Coord to)
+{
+    if (route.empty() or route.front() != std::make_pair(from, 0) or route.back().first != to) {
+        return false;
+    }
+    for (std::size_t i = 1; i < route.size(); ++i) {
+        auto fibres = ds.get_fibres_from(route.at(i - 1).first);
+        auto fibre = std::find_if(fibres.begin(), fibres.end(), [&](auto& f) { return f.first == route.at(i).first; });
+        if (fibre == fibres.end() or route.at(i).second != route.at(i - 1).second + fibre->second) {
+            return false;
+        }
+        for (std::size_t j = 0; j < i; ++j) {
+            if (route.at(j).first == route.at(i).first) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Compares route_k_fastest and routes_within_cost with every loopless route
+// of small random networks. Zero and equal costs give many ties.
+void test_alternative_routes()
+{
+    for (int network = 0; network < 40; ++network) {
+        Datastructures ds;
+        int const xpoints = 7;
+        for (int i = 0; i < 14; ++i) {
+            ds.add_fibre({random_in_range(0, xpoints - 1), 0}, {random_in_range(0, xpoints - 1), 0},
+                         random_in_range(0, 5));
+        }
+        Coord from = {0, 0};
+        Coord to = {xpoints - 1, 0};
+        if (ds.get_fibres_from(from).empty() or ds.get_fibres_from(to).empty()) {
+            continue;
+        }
+        Route start = {{from, 0}};
+        std::vector<Route> expected;
+        all_routes(ds, start, to, expected);
+        std::vector<Cost> expected_costs;
+        for (const auto& route : expected) {
+            expected_costs.push_back(route.back().second);
+        }
+        std::sort(expected_costs.begin(), expected_costs.end());
+
+        for (int k : {1, 3, 1000}) {
+            auto routes = ds.route_k_fastest(from, to, k);
+            CHECK(routes.size() == std::min(expected.size(), static_cast<std::size_t>(k)));
+            std::vector<Cost> costs;
+            for (const auto& route : routes) {
+                CHECK(valid_route(ds, route, from, to));
+                costs.push_back(route.back().second);
+            }
+            CHECK(std::is_sorted(costs.begin(), costs.end()));
+            CHECK(std::equal(costs.begin(), costs.end(), expected_costs.begin(),
+                             expected_costs.begin() + static_cast<long>(costs.size())));
+            auto unique = routes;
+            std::sort(unique.begin(), unique.end());
+            CHECK(std::adjacent_find(unique.begin(), unique.end()) == unique.end());
+        }
+
+        Cost max_cost = expected_costs.empty() ? 0 : expected_costs.at(expected_costs.size() / 2);
+        auto within = ds.routes_within_cost(from, to, max_cost);
+        std::vector<Route> expected_within;
+        std::copy_if(expected.begin(), expected.end(), std::back_inserter(expected_within),
+                     [&](auto& route) { return route.back().second <= max_cost; });
+        std::sort(within.begin(), within.end());
+        std::sort(expected_within.begin(), expected_within.end());
+        CHECK(within == expected_within);
+    }
+}
+
+// ---------------------------- Resumable route searches ---------------------
+
+// Runs the search to its end in slices of one to five xpoints
+SearchStatus run_in_slices(RouteSearch& search)
+{
+    while (!search.done()) {
+        search.step(static_cast<std::size_t>(random_in_range(1, 5)));
+    }
+    return search.status();
+}
+
+// A search resumed over many slices finds the same route as the one-shot
+// search, also when the network changes between the slices
+void test_resumed_searches()
+{
+    Datastructures ds;
+    int const side = 15;
+    build_grid(ds, side);
+    // A separate piece of network that the grid cannot reach
+    ds.add_fibre({100, 100}, {101, 100}, 1);
+
+    for (int i = 0; i < 40; ++i) {
+        Coord from = {random_in_range(0, side - 1), random_in_range(0, side - 1)};
+        Coord to = {random_in_range(0, side - 1), random_in_range(0, side - 1)};
+        if (i % 10 == 0) {
+            to = {101, 100};
+        }
+        for (SearchKind kind : {FASTEST_ROUTE, ANY_ROUTE}) {
+            auto expected = kind == FASTEST_ROUTE ? ds.route_fastest(from, to) : ds.route_any(from, to);
+            auto search = ds.begin_route_search(from, to, kind);
+            search.step(1);
+            // Later changes do not reach a search already begun
+            ds.update_fibre_cost({0, 0}, {1, 0}, random_in_range(1, 100));
+            auto status = run_in_slices(search);
+            CHECK(status == (expected.empty() ? NO_ROUTE : ROUTE_FOUND));
+            CHECK(search.route() == expected);
+            if (kind == FASTEST_ROUTE and !expected.empty()) {
+                CHECK(search.best_bound() == expected.back().second);
+            }
+
+            // Time slices give the same answer
+            expected = kind == FASTEST_ROUTE ? ds.route_fastest(from, to) : ds.route_any(from, to);
+            auto timed = ds.begin_route_search(from, to, kind);
+            while (!timed.done()) {
+                timed.step_for(std::chrono::microseconds(1));
+            }
+            CHECK(timed.route() == expected);
+        }
+    }
+}
+
+// ---------------------------- Spatial index -------------------------------
+
+using Segment = std::pair<Coord, Coord>;
+
+// Sign of the cross product of b - a and c - a
+int orientation(Coord a, Coord b, Coord c)
+{
+    auto cross = static_cast<std::int64_t>(b.x - a.x) * (c.y - a.y) - static_cast<std::int64_t>(b.y - a.y) * (c.x - a.x);
+    return (cross > 0) - (cross < 0);
+}
+
+bool boxes_overlap(Coord low1, Coord high1, Coord low2, Coord high2)
+{
+    return low1.x <= high2.x and low2.x <= high1.x and low1.y <= high2.y and low2.y <= high1.y;
+}
+
+Coord low_corner(Segment const& segment)
+{
+    return {std::min(segment.first.x, segment.second.x), std::min(segment.first.y, segment.second.y)};
+}
+
+Coord high_corner(Segment const& segment)
+{
+    return {std::max(segment.first.x, segment.second.x), std::max(segment.first.y, segment.second.y)};
+}
+
+// The segment touches the closed rectangle unless their bounding boxes are
+// apart or all corners of the rectangle are strictly on one side of its line
+bool touches_rectangle(Segment const& segment, Coord low, Coord high)
+{
+    if (!boxes_overlap(low_corner(segment), high_corner(segment), low, high)) {
+        return false;
+    }
+    int sides = 0;
+    for (Coord corner : {low, Coord{high.x, low.y}, high, Coord{low.x, high.y}}) {
+        sides |= 1 << (orientation(segment.first, segment.second, corner) + 1);
+    }
+    return sides != 1 and sides != 4;
+}
+
+// The closed segments share a point
+bool crosses(Segment const& s1, Segment const& s2)
+{
+    if (!boxes_overlap(low_corner(s1), high_corner(s1), low_corner(s2), high_corner(s2))) {
+        return false;
+    }
+    return orientation(s1.first, s1.second, s2.first) * orientation(s1.first, s1.second, s2.second) <= 0
+            and orientation(s2.first, s2.second, s1.first) * orientation(s2.first, s2.second, s1.second) <= 0;
+}
+
+// Compares the spatial queries with scans over every xpoint and fibre.
+// Coordinates are on both sides of zero, and fibres range from shorter than
+// a grid cell to longer than the index keeps in its cells.
+void test_spatial_queries()
+{
+    Datastructures ds;
+    auto near = [](Coord xy) { return Coord{xy.x + random_in_range(-20, 20), xy.y + random_in_range(-20, 20)}; };
+    auto anywhere = []() { return Coord{random_in_range(-300, 300), random_in_range(-300, 300)}; };
+    for (int i = 0; i < 600; ++i) {
+        Coord xy = anywhere();
+        switch (i % 4) {
+        case 0:
+        case 1:
+            ds.add_fibre(xy, near(xy), 1);
+            break;
+        case 2:
+            ds.add_fibre(xy, anywhere(), 1);
+            break;
+        default:
+            ds.add_fibre(xy, {random_in_range(-5000, 5000), random_in_range(-5000, 5000)}, 1);
+            break;
+        }
+    }
+
+    for (int round = 0; round < 2; ++round) {
+        auto xpoints = ds.all_xpoints();
+        auto fibres = ds.all_fibres();
+        std::sort(fibres.begin(), fibres.end());
+        for (int i = 0; i < 200; ++i) {
+            Coord xy = i % 10 == 0 ? Coord{random_in_range(-8000, 8000), random_in_range(-8000, 8000)} : anywhere();
+            auto by_distance = xpoints;
+            std::sort(by_distance.begin(), by_distance.end(), [xy](Coord a, Coord b) {
+                auto distance = [xy](Coord c) {
+                    return static_cast<std::int64_t>(c.x - xy.x) * (c.x - xy.x) + static_cast<std::int64_t>(c.y - xy.y) * (c.y - xy.y);
+                };
+                return std::make_pair(distance(a), a) < std::make_pair(distance(b), b);
+            });
+            CHECK(ds.nearest_xpoint(xy) == (by_distance.empty() ? NO_COORD : by_distance.front()));
+            auto k = random_in_range(0, 12);
+            by_distance.resize(std::min(by_distance.size(), static_cast<std::size_t>(k)));
+            CHECK(ds.nearest_xpoints(xy, k) == by_distance);
+
+            // Corners in either order
+            Coord corner1 = anywhere();
+            Coord corner2 = i % 3 == 0 ? near(corner1) : anywhere();
+            Coord low = {std::min(corner1.x, corner2.x), std::min(corner1.y, corner2.y)};
+            Coord high = {std::max(corner1.x, corner2.x), std::max(corner1.y, corner2.y)};
+            std::vector<Coord> inside;
+            std::copy_if(xpoints.begin(), xpoints.end(), std::back_inserter(inside), [&](Coord c) {
+                return boxes_overlap(c, c, low, high);
+            });
+            CHECK(ds.xpoints_in_rectangle(corner1, corner2) == inside);
+            std::vector<Segment> touching;
+            std::copy_if(fibres.begin(), fibres.end(), std::back_inserter(touching), [&](Segment const& fibre) {
+                return touches_rectangle(fibre, low, high);
+            });
+            CHECK(ds.fibres_in_rectangle(corner1, corner2) == touching);
+
+            Segment query = {corner1, i % 5 == 0 ? corner1 : corner2};
+            std::vector<Segment> crossing;
+            std::copy_if(fibres.begin(), fibres.end(), std::back_inserter(crossing), [&](Segment const& fibre) {
+                return crosses(query, fibre);
+            });
+            CHECK(ds.fibres_crossing(query.first, query.second) == crossing);
+        }
+
+        // Again after removing every other fibre
+        for (std::size_t i = 0; i < fibres.size(); i += 2) {
+            ds.remove_fibre(fibres.at(i).first, fibres.at(i).second);
+        }
+    }
+}
+
+// ---------------------------- Instrumentation -----------------------------
+
+// Call counts and work counters after a known sequence of operations. Built
+// without DATASTRUCTURES_STATS, nothing is recorded.
+void test_stats()
+{
+    Datastructures ds;
+    ds.add_beacon("A", "x", {1, 1}, {1, 2, 3});
+    ds.add_beacon("B", "x", {2, 2}, {4, 5, 6});
+    ds.add_beacon("C", "y", {3, 3}, {7, 8, 9});
+    ds.add_lightbeam("B", "A");
+    ds.add_lightbeam("C", "B");
+    ds.find_beacons("x");
+    ds.find_beacons("y");
+    ds.total_color("A");
+    ds.brightness_histogram(4);
+    // A line of three xpoints, all of which the search settles
+    ds.add_fibre({0, 0}, {1, 0}, 1);
+    ds.add_fibre({1, 0}, {2, 0}, 1);
+    ds.route_least_xpoints({0, 0}, {2, 0});
+    auto stats = ds.stats();
+    std::ostringstream printed;
+    ds.print_stats(printed);
+
+#ifdef DATASTRUCTURES_STATS
+    CHECK(stats["add_beacon"].calls == 3);
+    CHECK(stats["add_lightbeam"].calls == 2);
+    CHECK(stats["add_fibre"].calls == 2);
+    CHECK(stats["find_beacons"].calls == 2);
+    CHECK(stats["find_beacons"].entries_scanned == 3);
+    CHECK(stats["total_color"].max_depth == 3);
+    CHECK(stats["brightness_histogram"].entries_scanned == 3);
+    CHECK(stats["route_least_xpoints"].nodes_settled == 3);
+    CHECK(stats["route_least_xpoints"].edges_relaxed == 4);
+    for (auto const& op : stats) {
+        unsigned long histogram_calls = 0;
+        for (auto count : op.second.latency_histogram) {
+            histogram_calls += count;
+        }
+        CHECK(histogram_calls == op.second.calls);
+        CHECK(op.second.total_ns >= op.second.calls);
+    }
+    CHECK(stats.count("get_name") == 0);
+
+    auto text = printed.str();
+    CHECK(text.find("add_beacon: calls 3, mean ") != std::string::npos);
+    CHECK(text.find(", entries scanned 3\n") != std::string::npos);
+    CHECK(text.find(", max depth 3\n") != std::string::npos);
+    CHECK(text.find(", nodes settled 3, edges relaxed 4\n") != std::string::npos);
+
+    ds.reset_stats();
+    CHECK(ds.stats().empty());
+    ds.get_name("A");
+    stats = ds.stats();
+    CHECK(stats.size() == 1 and stats["get_name"].calls == 1);
+#else
+    CHECK(stats.empty());
+    CHECK(printed.str().empty());
+#endif
+}
+
+// ---------------------------- Memory usage --------------------------------
+
+// Bytes per beacon that the beacon storage must stay under. 20000 beacons
+// with lightbeams take about 170 bytes each: a 32-byte string for each of
+// the id and the name, the id index, the attribute columns, and 16-byte treap
+// nodes for both orders and both Euler tour tokens.
+std::size_t const MAX_BYTES_PER_BEACON = 185;
+
+void test_memory_usage()
+{
+    Datastructures ds;
+    unsigned int const n = 20000;
+    for (unsigned int i = 0; i < n; ++i) {
+        ds.add_beacon(beacon_id(i), random_name(), random_coord(), random_color());
+    }
+    for (unsigned int i = 1; i < n; ++i) {
+        ds.add_lightbeam(beacon_id(i), beacon_id(random_in_range(0u, i - 1)));
+    }
+    auto usage = ds.memory_usage();
+    std::size_t sum = 0;
+    for (const auto& structure : usage) {
+        if (structure.first != "total") {
+            sum += structure.second;
+        }
+    }
+    CHECK(usage["total"] == sum);
+    for (std::string structure : {"beacon columns", "beacon ids", "beacon names", "beacon orders", "lightbeam index"}) {
+        CHECK(usage[structure] > 0);
+    }
+    CHECK(usage["total"] / n < MAX_BYTES_PER_BEACON);
+
+    // Removed rows are reused, so the storage does not grow when beacons come and go
+    for (unsigned int i = 0; i < n; i += 2) {
+        ds.remove_beacon(beacon_id(i));
+        ds.add_beacon(beacon_id(n + i), random_name(), random_coord(), random_color());
+    }
+    CHECK(ds.memory_usage()["total"] <= usage["total"] + n);
+
+    ds.clear_beacons();
+    CHECK(ds.memory_usage()["total"] < usage["total"] / 100);
+}
+
+// ---------------------------- Coordinate hashing --------------------------
+
+// Distinct coordinates must get distinct hash values: a grid on both sides
+// of zero, and the extreme values of int
+void test_coord_hash()
+{
+    std::vector<std::size_t> hashes;
+    for (int y = -300; y <= 300; ++y) {
+        for (int x = -300; x <= 300; ++x) {
+            hashes.push_back(CoordHash()({x, y}));
+        }
+    }
+    int const limits[] = {std::numeric_limits<int>::min(), -1, 0, 1, std::numeric_limits<int>::max()};
+    for (int x : limits) {
+        for (int y : limits) {
+            if (std::abs(static_cast<long long>(x)) > 300 or std::abs(static_cast<long long>(y)) > 300) {
+                hashes.push_back(CoordHash()({x, y}));
+            }
+        }
+    }
+    auto count = hashes.size();
+    std::sort(hashes.begin(), hashes.end());
+    hashes.erase(std::unique(hashes.begin(), hashes.end()), hashes.end());
+    CHECK(hashes.size() == count);
+    CHECK(CoordHash()({1, 2}) != CoordHash()({2, 1}));
+}
+
+}
+
+int main()
+{
+    test_snapshot_queries();
+    test_snapshot_isolation();
+    test_concurrent_readers();
+    test_batch_orders();
+    test_batch_rename_then_remove();
+    test_batch_remove_then_add_fibre();
+    test_batch_begin_twice();
+    test_color_queries();
+    test_negative_costs();
+    test_hub_repairs();
+    test_hub_lifetime();
+    test_lightsource_index();
+    test_ingest_lightbeam_errors();
+    test_ingest_errors();
+    test_alternative_routes();
+    test_resumed_searches();
+    test_spatial_queries();
+    test_stats();
+    test_memory_usage();
+    test_coord_hash();
+
+    if (failures != 0) {
+        std::cerr << failures << " checks failed" << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cout << "All checks passed" << std::endl;
+    return EXIT_SUCCESS;
+}